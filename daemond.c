@@ -1,19 +1,38 @@
 /* daemond - process supervisor that can run as PID 1 (init) */
 
-#include <dirent.h>
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <sys/select.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#endif
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include "heap.h"
+#include "log.h"
 #include "service.h"
+#include "spawn.h"
+#include "sys.h"
+#ifdef SIM
+#include "sim.h" // after sys.h
+#endif
+#include "trace.h"
 #include "util.h"
 
 #ifndef ismodified
@@ -22,100 +41,442 @@
 )
 #endif
 
+#ifndef ENV_STATEFD
+#define ENV_STATEFD "DAEMOND_STATEFD"
+#endif
+
 const char *argv0;
+char **args;
 char **next_program;
 time_t timeout;
+time_t sample_interval;
+struct timespec sample_due;
+unsigned checks_max = 8;
+unsigned jobs_max;
+unsigned spawn_budget = 64;
 sigset_t sigmask_sync;
 
 volatile sig_atomic_t termflag;
+volatile sig_atomic_t reexecflag;
 Service *services;
 
+/* health checks are scheduled on a single heap of timers, and checks that are
+ * due while checks_max are already running queue up for a free slot
+ */
+static bool timer_before(const HeapNode *a, const HeapNode *b);
+Heap timers = {.before = timer_before};
+Service *checks_waiting;
+unsigned checks_running;
+
+/* services wait to be spawned by priority, at most spawn_budget per loop
+ * iteration so events are handled in between, and one-shots also wait for one
+ * of jobs_max slots
+ */
+static bool queue_before(const HeapNode *a, const HeapNode *b);
+Heap spawns = {.before = queue_before};
+Heap oneshots = {.before = queue_before};
+unsigned long long queued;
+unsigned oneshots_running;
+
+/* execdir while it is being scanned, new services found in it are set up at
+ * most spawn_budget per loop iteration as well
+ */
+void *scanning;
+
+/* fds to wait on: the log, -1 unless it has to wait, then the killfd and pidfd
+ * of each service that has them, see loop. new services are added by scan,
+ * otherwise it is only rebuilt on fdschanged
+ */
+struct pollfd *pollfds;
+Service **pollsrvs; // the service of each pollfd
+size_t pollfds_len, pollfds_cap;
+
 static void usage(void) {
-	dprintf(2, "usage: %s [-t timeout] [next_program [arg...]]\n", argv0);
+	dprintf(2,
+		"usage: %s [-z] [-b spawn_budget] [-c max_checks] [-j max_jobs] "
+		"[-s sample_interval] [-t timeout] [next_program [arg...]]\n",
+		argv0
+	);
 	exit(1);
 }
 
+static struct timespec now(void) {
+	struct timespec t;
+	sys->clock_gettime(CLOCK_MONOTONIC, &t);
+	return t;
+}
+
+static bool timespec_before(struct timespec a, struct timespec b) {
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static Service *timer_service(const HeapNode *node) {
+	return (Service *)((char *)node - offsetof(Service, timer));
+}
+
+static bool timer_before(const HeapNode *a, const HeapNode *b) {
+	return timespec_before(timer_service(a)->due, timer_service(b)->due);
+}
+
+static void schedule(Service *srv, unsigned seconds) {
+	srv->due = now();
+	srv->due.tv_sec += seconds;
+	if (heap_push(&timers, &srv->timer) < 0) {
+		LOG("%s: failed to schedule check: %s!", srv->name, err());
+	}
+}
+
+/* starts tracking the checks of a service that was just spawned, or of one
+ * whose check just ended. one waiting for a check slot is left there
+ */
+static void schedule_check(Service *srv) {
+	if (!srv->check.interval) {
+		heap_remove(&timers, &srv->timer);
+	} else if (srv->check.pid > 0) {
+		schedule(srv, srv->check.timeout);
+	} else if (!srv->timer.index && !srv->check.waiting) {
+		schedule(srv, srv->check.interval);
+	}
+}
+
+static void unschedule_check(Service *srv) {
+	heap_remove(&timers, &srv->timer);
+	for (Service **pos = &checks_waiting; srv->check.waiting && *pos;
+		pos = &(*pos)->check.next
+	) {
+		if (*pos == srv) {
+			*pos = srv->check.next;
+			srv->check.waiting = false;
+		}
+	}
+	if (srv->check.pid > 0) --checks_running;
+}
+
+static void run_checks(void) {
+	struct timespec t = now();
+	Service **tail = &checks_waiting;
+	while (*tail) tail = &(*tail)->check.next;
+	HeapNode *node;
+	while ((node = heap_peek(&timers))) {
+		Service *srv = timer_service(node);
+		if (timespec_before(t, srv->due)) break;
+		heap_remove(&timers, node);
+		if (srv->pid <= 0) {
+			continue; // a one-shot that is done
+		} else if (srv->check.pid > 0) {
+			service_checktimeout(srv); // rescheduled once reaped
+		} else if (!srv->check.waiting) {
+			srv->check.waiting = true;
+			srv->check.next = NULL;
+			*tail = srv;
+			tail = &srv->check.next;
+		}
+	}
+	while (checks_waiting && checks_running < checks_max) {
+		Service *srv = checks_waiting;
+		checks_waiting = srv->check.next;
+		srv->check.waiting = false;
+		if (srv->pid <= 0) continue;
+		service_check(srv);
+		checks_running += srv->check.pid > 0;
+		schedule_check(srv);
+	}
+}
+
+static Service *queue_service(const HeapNode *node) {
+	return (Service *)((char *)node - offsetof(Service, queue));
+}
+
+static bool queue_before(const HeapNode *a, const HeapNode *b) {
+	Service *x = queue_service(a), *y = queue_service(b);
+	if (x->priority != y->priority) return x->priority > y->priority;
+	return x->queued < y->queued;
+}
+
+static Heap *queue_heap(Service *srv) {
+	return srv->oneshot ? &oneshots : &spawns;
+}
+
+static void queue(Service *srv) {
+	service_setstate(srv, SERVICE_PENDING);
+	srv->queued = queued++;
+	if (heap_push(queue_heap(srv), &srv->queue) < 0) {
+		LOG("%s: failed to queue spawn: %s!", srv->name, err());
+	}
+}
+
+/* the next service that may be spawned */
+static HeapNode *queue_peek(void) {
+	HeapNode *a = heap_peek(&spawns), *b = NULL;
+	if (oneshots_running < jobs_max) b = heap_peek(&oneshots);
+	return !b || (a && queue_before(a, b)) ? a : b;
+}
+
+static void spawned(Service *srv) {
+	if (srv->pid > 0) {
+		schedule_check(srv);
+		return;
+	}
+	oneshots_running -= srv->oneshot;
+	if (!srv->oneshot) {
+		// most likely its executable is gone
+		LOG("%s service removed", srv->name);
+		unschedule_check(srv);
+		service_destroy(service_delete(srv->prev));
+	}
+}
+
+/* requests to the spawner are pipelined, and all answered before returning */
+static void run_spawns(void) {
+	HeapNode *node;
+	Service *srv;
+	for (unsigned n = 0; n < spawn_budget && (node = queue_peek()); ++n) {
+		srv = queue_service(node);
+		heap_remove(queue_heap(srv), node);
+		oneshots_running += srv->oneshot; // also while waiting for the pid
+		if (service_spawn(srv)) spawned(srv);
+		while ((srv = service_spawned(false))) spawned(srv);
+	}
+	while ((srv = service_spawned(true))) spawned(srv);
+}
+
+static void sample(void) {
+	struct timespec t = now();
+	if (!sample_interval || timespec_before(t, sample_due)) return;
+	for (Service *srv = services; srv; srv = srv->next) service_sample(srv, t);
+	sample_due = t;
+	sample_due.tv_sec += sample_interval;
+}
+
+/* shortens the pselect timeout in *tp to end at due */
+static struct timespec *wake_at(struct timespec due,
+	struct timespec *ts, struct timespec *tp
+) {
+	struct timespec t = now();
+	if (timespec_before(due, t)) due = t;
+	due.tv_sec -= t.tv_sec;
+	due.tv_nsec -= t.tv_nsec;
+	if (due.tv_nsec < 0) {
+		due.tv_nsec += 1000000000;
+		--due.tv_sec;
+	}
+	if (!tp || timespec_before(due, *tp)) *ts = due;
+	return ts;
+}
+
+static bool pollfds_reserve(size_t n) {
+	if (n <= pollfds_cap) return true;
+	n = MAX(n, pollfds_cap * 2);
+	struct pollfd *fds = realloc(pollfds, n * sizeof(*fds));
+	if (fds) pollfds = fds;
+	Service **srvs = fds ? realloc(pollsrvs, n * sizeof(*srvs)) : NULL;
+	if (!srvs) {
+		LOG("failed to allocate pollfds: %s!", err());
+		return false;
+	}
+	pollsrvs = srvs;
+	pollfds_cap = n;
+	return true;
+}
+
+static void pollfds_add(Service *srv) {
+	int fds[] = {srv->killfd, srv->pidfd};
+	for (size_t i = 0; i < lenof(fds); ++i) {
+		if (fds[i] < 0) continue;
+		pollfds[pollfds_len].fd = fds[i];
+		pollfds[pollfds_len].events = POLLIN;
+		pollsrvs[pollfds_len++] = srv;
+	}
+}
+
 static void scan(void) {
-	{
+	if (!scanning) {
 		static struct timespec scantime;
 		struct stat st;
-		if (stat(execdir, &st) < 0) {
+		if (sys->fstatat(AT_FDCWD, execdir, &st, 0) < 0) {
 			LOG("failed to stat execdir: %s", err());
 		} else if (ismodified(st.st_mtim, scantime)) {
 			scantime = st.st_mtim;
 		} else {
 			return;
 		}
+
+		TRACE0(scan_start);
+		int fd = sys->openat(AT_FDCWD, execdir,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0
+		);
+		scanning = fd < 0 ? NULL : sys->opendir(fd);
+		if (!scanning) {
+			LOG("failed to open execdir: %s", err());
+			if (fd >= 0) sys->close(fd);
+			TRACE0(scan_done);
+			return;
+		}
+		// services are spawned relative to this, and execdir may have been
+		// replaced
+		if (execdirfd >= 0) sys->close(execdirfd);
+		execdirfd = fd;
+		service_invalidate(NULL);
 	}
 
-	// i don't like dirent
-	DIR *dir = opendir(execdir);
-	if (!dir) LOG("failed to open execdir: %s", err());
-	struct dirent *srvfile;
-	while ((srvfile = readdir(dir))) {
-		if (*srvfile->d_name == '.') continue;
-		Service **pos = service_from_name(&services, srvfile->d_name);
-		if (*pos) continue;
-		Service *srv = service(srvfile->d_name);
+	// changes while scanning are picked up by the next scan, as the mtime
+	// was taken before
+	const char *name = NULL;
+	for (unsigned n = 0; n < spawn_budget && (name = sys->readdir(scanning));) {
+		if (*name == '.') continue;
+		if (service_from_name(name)) continue;
+		Service *srv = service(name);
+		++n;
 		if (!srv) continue;
-		service_spawn(srv);
-		if (srv->pid > 0) {
-			service_insert(pos, srv);
-			LOG("%s service added", srv->name);	service_destroy(srv);
-			continue;
+		service_configure(srv);
+		service_insert(&services, srv);
+		if (service_adopt(srv) >= 0) {
+			oneshots_running += srv->oneshot;
+			schedule_check(srv);
+		} else {
+			queue(srv);
+		}
+		// appended, rather than rebuilding for every batch of new services
+		if (!fdschanged && pollfds_len && pollfds_reserve(pollfds_len + 2)) {
+			pollfds_add(srv);
+		} else {
+			fdschanged = true;
 		}
-		service_destroy(srv);
+		LOG("%s service added", srv->name);
 	}
-	closedir(dir);
+	if (name) return; // more in the next iteration
+	sys->closedir(scanning);
+	scanning = NULL;
+	TRACE0(scan_done);
+}
+
+/* carries out up, down and restart for a service that is not running */
+static void control(Service *srv) {
+	if (srv->down) {
+		heap_remove(queue_heap(srv), &srv->queue);
+		if (srv->state != SERVICE_DOWN) service_setstate(srv, SERVICE_DOWN);
+	} else if (srv->start) {
+		srv->start = false;
+		if (!srv->queue.index) queue(srv);
+	}
+}
+
+/* status is from waitpid, or -1 if the process was not our child */
+static void gone(Service *srv, int status) {
+	service_stopped(srv);
+	// rather than counting it against the next instance, or letting that
+	// reschedule its timeout
+	if (srv->check.pid > 0) {
+		--checks_running;
+		heap_remove(&timers, &srv->timer);
+		service_uncheck(srv);
+	}
+	if (!srv->oneshot && !srv->down) {
+		srv->start = false;
+		queue(srv);
+		return;
+	}
+	oneshots_running -= srv->oneshot;
+	// a restarted one-shot goes straight back to pending, the result of the
+	// instance it stopped would only confuse whoever waits for the new one
+	if (srv->oneshot && (srv->down || !srv->start)) {
+		service_setstate(srv,
+			status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0 ?
+			SERVICE_SUCCEEDED : SERVICE_FAILED
+		);
+	}
+	control(srv);
+}
+
+static void exited(Service *srv, pid_t pid, int status) {
+	const char *name = srv ? srv->name : "";
+	TRACE3(reap, name, pid, status);
+	if (WIFEXITED(status)) {
+		LOG("%s[%li] exited with code %i",
+			name, (long)pid, (int)WEXITSTATUS(status)
+		);
+	} else {
+		int sig = WTERMSIG(status);
+		LOG("%s[%li] terminated by signal %s[%i]",
+			name, (long)pid, strsignal(sig), sig
+		);
+	}
+	if (srv) gone(srv, status);
 }
 
 static void reap(void) {
 	int status;
 	pid_t pid;
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		Service **srv = service_from_pid(&services, pid);
-		const char *name = *srv ? (*srv)->name : "";
-		if (WIFEXITED(status)) {
-			LOG("%s[%li] exited with code %i",
-				name, (long)pid, (int)WEXITSTATUS(status)
-			);
-		} else {
-			int sig = WTERMSIG(status);
-			LOG("%s[%li] terminated by signal %s[%i]",
-				name, (long)pid, strsignal(sig), sig
-			);
-		}
-		if (*srv) {
-			service_spawn(*srv);
-			if ((*srv)->pid < 0) {
-				service_destroy(service_delete(srv));
-				LOG("%s service removed", name);
-			}
+	while ((pid = sys->waitpid(-1, &status, WNOHANG)) > 0) {
+		Service *chk = service_from_checkpid(pid);
+		if (chk) {
+			TRACE3(check_reap, chk->name, pid, status);
+			--checks_running;
+			service_checked(chk, status);
+			heap_remove(&timers, &chk->timer); // its timeout
+			if (chk->pid > 0) schedule_check(chk);
+			continue;
 		}
+		if (pid == zygotepid) zygotepid = 0; // mustn't be killed any more
+		exited(service_from_pid(pid), pid, status);
+	}
+}
+
+/* adopted processes are usually not our children, so all we learn is that
+ * they are gone
+ */
+static void reap_adopted(Service *srv) {
+	int status;
+	pid_t pid = srv->pid;
+	if (sys->waitpid(pid, &status, WNOHANG) == pid) {
+		exited(srv, pid, status);
+	} else {
+		LOG("%s[%li] exited", srv->name, (long)pid);
+		gone(srv, -1);
+	}
+}
+
+static void rebuild_pollfds(void) {
+	size_t need = 1;
+	for (Service *srv = services; srv; srv = srv->next) need += 2;
+	if (!pollfds_reserve(need)) {
+		pollfds_len = 0;
+		return;
 	}
+	fdschanged = false;
+	pollfds[0] = (struct pollfd){.fd = -1, .events = POLLOUT};
+	pollfds_len = 1;
+	for (Service *srv = services; srv; srv = srv->next) pollfds_add(srv);
 }
 
 static void loop(void) {
 	scan();
+	service_handlewatch();
 	reap();
+	run_spawns();
+	run_checks();
+	sample();
 
-	int nfds = 0;
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	for (Service *srv = services; srv; srv = srv->next) {
-		if (srv->killfd < 0) continue;
-		if (srv->killfd >= nfds) nfds = srv->killfd + 1;
-		FD_SET(srv->killfd, &readfds);
-	}
-	nfds = pselect(nfds, &readfds, NULL, NULL,
-		timeout > 0 ? &(struct timespec){.tv_sec = timeout} : NULL,
-		&sigmask_sync
-	);
+	if (fdschanged) rebuild_pollfds();
+	if (pollfds_len) pollfds[0].fd = log_flush() ? logfd : -1;
+	struct timespec ts = {.tv_sec = timeout}, *tp = timeout > 0 ? &ts : NULL;
+	HeapNode *node = heap_peek(&timers);
+	if (node) tp = wake_at(timer_service(node)->due, &ts, tp);
+	if (queue_peek() || scanning) tp = wake_at(now(), &ts, tp); // more to do
+	if (sample_interval) tp = wake_at(sample_due, &ts, tp);
+	int n = sys->ppoll(pollfds, pollfds_len, tp, &sigmask_sync);
 
-	for (Service *srv = services; srv && nfds > 0; srv = srv->next) {
-		if (FD_ISSET(srv->killfd, &readfds)) {
+	// once the fds changed the rest is left for the next iteration, the
+	// services may even be gone
+	for (size_t i = 1; n > 0 && i < pollfds_len && !fdschanged; ++i) {
+		if (!pollfds[i].revents) continue;
+		--n;
+		Service *srv = pollsrvs[i];
+		if (pollfds[i].fd == srv->killfd) {
 			service_handlekill(srv);
-			--nfds;
+			if (srv->pid <= 0) control(srv);
+		} else {
+			reap_adopted(srv);
 		}
 	}
 }
@@ -124,19 +485,137 @@ static void terminate(int sig) {
 	termflag = 1;
 }
 
+static void reexec_request(int sig) {
+	reexecflag = 1;
+}
+
 static void signop(int sig) {/* interrupts pselect */}
 
+/* the supervisor holds several fds per service, more than the usual soft limit
+ * allows for many services. whatever it execs gets the inherited limit back
+ */
+static void setnofile(bool raise) {
+	struct rlimit rl = spawn_nofile;
+	if (raise) rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		LOG("failed to set the limit on open files: %s", err());
+	}
+}
+
+/* replaces the process image with a fresh one of the same binary, passing the
+ * service table along in an anonymous file. children stay children across
+ * exec, so nothing is respawned
+ */
+static void reexec(void) {
+	reexecflag = 0;
+	int fd = -1;
+#ifdef __linux__
+	fd = memfd_create("daemond", 0);
+#endif
+	if (fd < 0) {
+		FILE *f = tmpfile();
+		if (f) {
+			fd = dup(fileno(f));
+			fclose(f);
+		}
+	}
+	if (fd < 0 || service_save(services, fd) < 0) {
+		LOG("failed to save service table: %s!", err());
+		if (fd >= 0) close(fd);
+		return;
+	}
+	char buf[snprintf(NULL, 0, "%i", fd) + 1];
+	snprintf(buf, sizeof(buf), "%i", fd);
+	setenv(ENV_STATEFD, buf, 1);
+	service_inherit(services, true);
+	LOG("re-executing %s", *args);
+	log_drain();
+	setnofile(false);
+	execvp(*args, args); // keeps the signal mask, see main
+	log_init();
+	LOG("failed to re-execute: %s!", err());
+	setnofile(true);
+	service_inherit(services, false);
+	unsetenv(ENV_STATEFD);
+	close(fd);
+}
+
+static void restore(void) {
+	const char *str = getenv(ENV_STATEFD);
+	if (!str) return;
+	char *p = (char *)str;
+	int fd = parseuint(&p, INT_MAX, 10);
+	bool valid = !*p && p != str;
+	// before loading, so it doesn't end up in the environment of services
+	unsetenv(ENV_STATEFD);
+	if (!valid) {
+		LOG("invalid %s!", ENV_STATEFD);
+	} else {
+		if (service_load(&services, fd) < 0) {
+			LOG("failed to load service table: %s!", err());
+		}
+		close(fd);
+		size_t n = 0;
+		for (Service *srv = services; srv; srv = srv->next) {
+			if (srv->check.pid > 0) ++checks_running;
+			if (srv->state == SERVICE_PENDING) {
+				queue(srv);
+			} else if (srv->oneshot && srv->pid > 0) {
+				++oneshots_running;
+			}
+			schedule_check(srv);
+			++n;
+		}
+		LOG("restored %zu services", n);
+	}
+}
+
 static void exec_next(void) {
+	setnofile(false);
 	execvp(*next_program, next_program);
 	LOG("failed to exec next_program: %s", err());
+	log_drain();
 }
 
 int main(int argc, char **argv) {
+	bool zygote = false;
 	int c;
 
 	argv0 = *argv;
-	while ((c = getopt(argc, argv, "t:")) >= 0) {
+	args = argv;
+#ifdef SIM
+	sim_init();
+#endif
+	while ((c = getopt(argc, argv, "b:c:j:s:t:z")) >= 0) {
 		switch (c) {
+		case 'b':
+			{
+				char *p = optarg;
+				spawn_budget = parseuint(&p, UINT_MAX, 10);
+				if (p == optarg || *p || !spawn_budget) usage();
+				break;
+			}
+		case 'c':
+			{
+				char *p = optarg;
+				checks_max = parseuint(&p, UINT_MAX, 10);
+				if (p == optarg || *p || !checks_max) usage();
+				break;
+			}
+		case 'j':
+			{
+				char *p = optarg;
+				jobs_max = parseuint(&p, UINT_MAX, 10);
+				if (p == optarg || *p || !jobs_max) usage();
+				break;
+			}
+		case 's':
+			{
+				char *p = optarg;
+				sample_interval = parseuint(&p, INT_MAX, 10);
+				if (p == optarg || *p) usage();
+				break;
+			}
 		case 't':
 			{
 				char *endptr;
@@ -145,12 +624,34 @@ int main(int argc, char **argv) {
 				timeout = i;
 				break;
 			}
+		case 'z':
+			zygote = true;
+			break;
 		default:
 			usage();
 		}
 	}
+	if (!jobs_max) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs_max = n > 0 ? n : 1;
+	}
+	if (getrlimit(RLIMIT_NOFILE, &spawn_nofile) < 0) {
+		LOG("failed to get the limit on open files: %s", err());
+	} else {
+		setnofile(true);
+	}
+#ifdef SIM
+	if (zygote) LOG("the spawner is not simulated, forking directly");
+#else
+	// before anything else is set up, so the spawner stays small
+	if (zygote && (zygotefd = spawn_zygote(&zygotepid, &zygotepids)) < 0) {
+		LOG("failed to start spawner: %s, forking directly", err());
+	}
+#endif
 	next_program = argv + optind;
 	if (*next_program) atexit(exec_next);
+	log_init();
+	atexit(log_drain);
 
 	struct sigaction sa = {0};
 	errno = 0;
@@ -158,18 +659,41 @@ int main(int argc, char **argv) {
 		DIE("failed to init signal mask: %s", err());
 	}
 	sigaddset(&sa.sa_mask, SIGCHLD);
+	sigaddset(&sa.sa_mask, SIGHUP);
 	sigaddset(&sa.sa_mask, SIGINT);
 	sigaddset(&sa.sa_mask, SIGTERM);
 	if (errno || sigprocmask(SIG_BLOCK, &sa.sa_mask, &sigmask_sync) < 0) {
 		DIE("failed to set signal mask: %s", err());
 	}
+	// the mask may have been inherited from before a re-exec
+	sigdelset(&sigmask_sync, SIGCHLD);
+	sigdelset(&sigmask_sync, SIGHUP);
+	sigdelset(&sigmask_sync, SIGINT);
+	sigdelset(&sigmask_sync, SIGTERM);
 	sa.sa_handler = terminate;
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = reexec_request;
+	sigaction(SIGHUP, &sa, NULL);
 	sa.sa_handler = signop;
 	sa.sa_flags = SA_NOCLDSTOP;
 	sigaction(SIGCHLD, &sa, NULL);
 	if (errno) DIE("failed to set signal handlers: %s", err());
 
-	while (!termflag) loop();
+#ifdef PR_SET_CHILD_SUBREAPER
+	// orphans of services that daemonize or were adopted come back to us
+	if (getpid() != 1 && prctl(PR_SET_CHILD_SUBREAPER, 1) < 0) {
+		LOG("failed to become subreaper: %s", err());
+	}
+#endif
+
+	watchfd = sys->watchinit();
+	if (watchfd < 0 && errno != ENOSYS) {
+		LOG("failed to watch service directories: %s", err());
+	}
+	restore();
+	while (!termflag) {
+		loop();
+		if (reexecflag) reexec();
+	}
 }
@@ -86,7 +86,7 @@ const Getsignal getsignals[] = {
 int getsignal(const char *name) {
 	char *p = (char *)name;
 	int num = parseuint(&p, INT_MAX, 10);
-	if (*p) {
+	if (!*p) {
 		return num;
 	} else if (p != name) {
 		return 0;
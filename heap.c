@@ -0,0 +1,77 @@
+/* heap - intrusive binary min-heap, used for timers and queues */
+
+#include <stdlib.h>
+
+#include "heap.h"
+#include "util.h"
+
+static void heap_set(Heap *self, size_t i, HeapNode *node) {
+	self->nodes[i] = node;
+	node->index = i + 1;
+}
+
+static void heap_up(Heap *self, size_t i) {
+	HeapNode *node = self->nodes[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (!self->before(node, self->nodes[parent])) break;
+		heap_set(self, i, self->nodes[parent]);
+		i = parent;
+	}
+	heap_set(self, i, node);
+}
+
+static void heap_down(Heap *self, size_t i) {
+	HeapNode *node = self->nodes[i];
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= self->len) break;
+		if (child + 1 < self->len &&
+			self->before(self->nodes[child + 1], self->nodes[child])
+		) ++child;
+		if (!self->before(self->nodes[child], node)) break;
+		heap_set(self, i, self->nodes[child]);
+		i = child;
+	}
+	heap_set(self, i, node);
+}
+
+/* also repositions a node that is already in the heap after its key changed */
+int heap_push(Heap *self, HeapNode *node) {
+	if (node->index) {
+		heap_up(self, node->index - 1);
+		heap_down(self, node->index - 1);
+		return 0;
+	}
+	if (self->len >= self->cap) {
+		size_t cap = MAX(self->cap * 2, 16);
+		HeapNode **nodes = realloc(self->nodes, cap * sizeof(*nodes));
+		if (!nodes) return -1;
+		self->nodes = nodes;
+		self->cap = cap;
+	}
+	self->nodes[self->len] = node;
+	heap_up(self, self->len++);
+	return 0;
+}
+
+HeapNode *heap_peek(Heap *self) {
+	return self->len ? *self->nodes : NULL;
+}
+
+HeapNode *heap_pop(Heap *self) {
+	HeapNode *node = heap_peek(self);
+	if (node) heap_remove(self, node);
+	return node;
+}
+
+void heap_remove(Heap *self, HeapNode *node) {
+	if (!node->index) return;
+	size_t i = node->index - 1;
+	node->index = 0;
+	HeapNode *last = self->nodes[--self->len];
+	if (last == node) return;
+	self->nodes[i] = last;
+	heap_up(self, i);
+	heap_down(self, last->index - 1);
+}
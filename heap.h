@@ -0,0 +1,22 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Heap Heap;
+typedef struct HeapNode HeapNode;
+
+/* embed in the element, recover it with offsetof */
+struct HeapNode {
+	size_t index; // 0 when not in a heap
+};
+
+struct Heap {
+	HeapNode **nodes;
+	size_t len;
+	size_t cap;
+	bool (*before)(const HeapNode *a, const HeapNode *b);
+};
+
+int heap_push(Heap *self, HeapNode *node);
+HeapNode *heap_peek(Heap *self);
+HeapNode *heap_pop(Heap *self);
+void heap_remove(Heap *self, HeapNode *node);
@@ -0,0 +1,161 @@
+/* log - buffers our own log so a slow or full stderr never blocks supervision
+ * lines go into a ring buffer and are written out in batches without blocking
+ * when the buffer is full, lines are dropped and counted instead
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "util.h"
+
+#ifndef LOG_SIZE
+#define LOG_SIZE 65536
+#endif
+#ifndef LOG_LINE
+#define LOG_LINE 1024
+#endif
+
+int logfd = 2;
+
+static char ring[LOG_SIZE];
+static size_t head; // oldest unwritten byte
+static size_t len;
+static unsigned long dropped;
+
+/* the file status flags of stderr are shared with whoever else has it, so
+ * they are left alone and writes are kept from blocking in another way
+ */
+static enum {
+	LOG_BLOCKING, // a regular file, or not set up yet
+	LOG_PRIVATE, // logfd is our own non-blocking open of stderr
+	LOG_SOCKET, // send with MSG_DONTWAIT
+	LOG_POLL // write at most PIPE_BUF when polled writable
+} logmode;
+
+static bool log_append(const char *line, size_t n) {
+	if (n > lenof(ring) - len) return false;
+	size_t tail = (head + len) % lenof(ring);
+	size_t first = MIN(n, lenof(ring) - tail);
+	memcpy(ring + tail, line, first);
+	memcpy(ring, line + first, n - first);
+	len += n;
+	return true;
+}
+
+/* may be called again after log_drain */
+void log_init(void) {
+	struct stat st;
+	if (logfd != 2) close(logfd);
+	logfd = 2;
+	if (fstat(2, &st) < 0 || S_ISREG(st.st_mode)) {
+		logmode = LOG_BLOCKING;
+	} else if (S_ISSOCK(st.st_mode)) {
+		logmode = LOG_SOCKET;
+	} else {
+		logmode = LOG_POLL;
+#ifdef __linux__
+		// a new open file description of the same pipe or terminal
+		int fd = open("/proc/self/fd/2",
+			O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC
+		);
+		if (fd >= 0) {
+			logfd = fd;
+			logmode = LOG_PRIVATE;
+		}
+#endif
+	}
+}
+
+static ssize_t log_write(struct iovec *iov, int n, bool block) {
+	struct pollfd pfd = {.fd = logfd, .events = POLLOUT};
+	switch (block ? LOG_BLOCKING : logmode) {
+	case LOG_SOCKET:
+		return sendmsg(logfd, &(struct msghdr){.msg_iov = iov, .msg_iovlen = n},
+			MSG_DONTWAIT | MSG_NOSIGNAL
+		);
+	case LOG_POLL:
+		// pipes take up to PIPE_BUF without blocking once writable
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLOUT)) {
+			return errno = EAGAIN, -1;
+		}
+		iov[0].iov_len = MIN(iov[0].iov_len, PIPE_BUF);
+		return write(logfd, iov[0].iov_base, iov[0].iov_len);
+	default:
+		return writev(logfd, iov, n);
+	}
+}
+
+void log_printf(const char *format, ...) {
+	char line[LOG_LINE];
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	int n = snprintf(line, sizeof(line), "%lli.%06li ",
+		(long long)t.tv_sec, t.tv_nsec / 1000
+	);
+	va_list ap;
+	va_start(ap, format);
+	int m = vsnprintf(line + n, sizeof(line) - n, format, ap);
+	va_end(ap);
+	if (m < 0) return;
+	n += m;
+	if (n >= (int)sizeof(line)) { // truncated, keep the line terminated
+		n = sizeof(line) - 1;
+		line[n - 1] = '\n';
+	}
+	if (!log_append(line, n)) ++dropped;
+}
+
+static bool log_write_all(bool block) {
+	while (len) {
+		size_t first = MIN(len, lenof(ring) - head);
+		struct iovec iov[] = {
+			{.iov_base = ring + head, .iov_len = first},
+			{.iov_base = ring, .iov_len = len - first}
+		};
+		ssize_t n = log_write(iov, iov[1].iov_len ? 2 : 1, block);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && !block) {
+				return true;
+			}
+			len = 0; // nowhere to log to
+			break;
+		}
+		head = (head + n) % lenof(ring);
+		len -= n;
+		if (!len) head = 0;
+		if (len || !dropped) continue;
+		unsigned long n_dropped = dropped;
+		dropped = 0;
+		log_printf("%s: %lu log lines dropped!\n", argv0, n_dropped);
+	}
+	return false;
+}
+
+/* writes as much as possible without blocking
+ * returns true if there is more to write
+ */
+bool log_flush(void) {
+	return log_write_all(false);
+}
+
+/* blocking flush for exit and exec */
+void log_drain(void) {
+	if (logmode == LOG_PRIVATE) {
+		int flags = fcntl(logfd, F_GETFL);
+		if (flags >= 0) fcntl(logfd, F_SETFL, flags & ~O_NONBLOCK);
+	}
+	log_write_all(true);
+}
@@ -0,0 +1,11 @@
+#include <stdbool.h>
+
+/* must be included before util.h to take over its LOG macros */
+#define LOG_PRINTF log_printf
+
+extern int logfd;
+
+void log_init(void);
+void log_printf(const char *format, ...);
+bool log_flush(void);
+void log_drain(void);
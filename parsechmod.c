@@ -71,7 +71,7 @@ int parsechmod(const char *str, mode_t *modep, mode_t mask) {
 		if (!*p) break;
 		++p;
 	}
-	if (!*p) return -1;
+	if (*p) return -1;
 	*modep = mode;
 	return 0;
 }
@@ -0,0 +1,137 @@
+/* proc - process information that is only available from the kernel */
+
+#ifdef __linux__
+#define _GNU_SOURCE // syscall
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "proc.h"
+#include "sys.h"
+#include "util.h"
+
+#ifdef __linux__
+static int proc_open(pid_t pid, const char *file) {
+	char path[snprintf(NULL, 0, "/proc/%li/%s", (long)pid, file) + 1];
+	snprintf(path, sizeof(path), "/proc/%li/%s", (long)pid, file);
+	return sys->openat(AT_FDCWD, path, O_RDONLY | O_CLOEXEC, 0);
+}
+
+/* procfs regenerates the file on every read at offset 0 */
+static int proc_read(int fd, char *buf, size_t size) {
+	ssize_t n = sys->pread(fd, buf, size - 1, 0);
+	if (n < 0) return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+/* field numbers as in proc(5), starting after comm which may contain anything
+ * so can't be split on spaces
+ */
+static int proc_statfield(const char *buf, int field,
+	unsigned long long *value
+) {
+	const char *p = strrchr(buf, ')');
+	if (!p) return errno = EINVAL, -1;
+	for (int i = 2; i < field; ++i) {
+		p = strchr(p + 1, ' ');
+		if (!p) return errno = EINVAL, -1;
+	}
+	char *end = (char *)++p;
+	*value = parseuint(&end, ULLONG_MAX, 10);
+	if (end == p) return errno = EINVAL, -1;
+	return 0;
+}
+#endif
+
+/* start time of pid in clock ticks since boot
+ * together with the pid this identifies a process, pids alone get recycled
+ */
+int proc_starttime(pid_t pid, unsigned long long *starttime) {
+#ifdef __linux__
+	char buf[512];
+	int fd = proc_open(pid, "stat");
+	if (fd < 0) return -1;
+	int ret = proc_read(fd, buf, sizeof(buf));
+	sys->close(fd);
+	if (ret < 0) return -1;
+	return proc_statfield(buf, 22, starttime);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* fd that becomes readable when pid exits, works for processes that are not
+ * our children
+ */
+int proc_pidfd(pid_t pid) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	return syscall(SYS_pidfd_open, pid, 0); // always close-on-exec
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* the fds stay valid as long as the process exists, so sampling doesn't need
+ * any path lookups
+ */
+int proc_openusage(pid_t pid, int fds[2]) {
+#ifdef __linux__
+	fds[0] = proc_open(pid, "stat");
+	fds[1] = fds[0] < 0 ? -1 : proc_open(pid, "statm");
+	if (fds[1] >= 0) return 0;
+	proc_closeusage(fds);
+	return -1;
+#else
+	fds[0] = fds[1] = -1;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void proc_closeusage(int fds[2]) {
+	if (fds[0] >= 0) sys->close(fds[0]);
+	if (fds[1] >= 0) sys->close(fds[1]);
+	fds[0] = fds[1] = -1;
+}
+
+/* cputime in milliseconds of user and system time, rss in KiB */
+int proc_usage(const int fds[2], unsigned long long *cputime,
+	unsigned long long *rss
+) {
+#ifdef __linux__
+	static long tck, pagesize;
+	if (!tck) {
+		tck = sysconf(_SC_CLK_TCK);
+		pagesize = sysconf(_SC_PAGESIZE) / 1024;
+	}
+	char buf[512];
+	unsigned long long utime, stime;
+	if (proc_read(fds[0], buf, sizeof(buf)) < 0 ||
+		proc_statfield(buf, 14, &utime) < 0 ||
+		proc_statfield(buf, 15, &stime) < 0 ||
+		proc_read(fds[1], buf, sizeof(buf)) < 0
+	) return -1;
+	*cputime = (utime + stime) * 1000 / tck;
+	char *p = strchr(buf, ' '), *end;
+	if (!p) return errno = EINVAL, -1;
+	end = ++p;
+	*rss = parseuint(&end, ULLONG_MAX, 10) * pagesize;
+	if (end == p) return errno = EINVAL, -1;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
@@ -0,0 +1,11 @@
+#include <sys/types.h>
+
+int proc_starttime(pid_t pid, unsigned long long *starttime);
+int proc_pidfd(pid_t pid);
+
+/* resource usage sampling, fds[0] is stat and fds[1] is statm */
+int proc_openusage(pid_t pid, int fds[2]);
+void proc_closeusage(int fds[2]);
+int proc_usage(const int fds[2], unsigned long long *cputime,
+	unsigned long long *rss
+);
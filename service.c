@@ -1,18 +1,36 @@
 /* service - handles service resources and control interfaces */
 
+#ifdef __linux__
+#define _GNU_SOURCE // O_PATH, execveat
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "getsignal.h"
+#include "heap.h"
+#include "log.h"
+#include "proc.h"
 #include "service.h"
+#include "spawn.h"
+#include "sys.h"
+#include "table.h"
+#include "trace.h"
 #include "util.h"
 
 #define SERVICE_LOG(self, ...) SERVICE_LOG_INTERNAL_((self), __VA_ARGS__, "")
@@ -21,34 +39,158 @@
 	LOG_INTERNAL_("%s: " f, self->name, __VA_ARGS__) \
 )
 
+/* directories are only used as starting points for *at calls */
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+#define O_DIRFD (O_PATH | O_DIRECTORY | O_CLOEXEC)
+
+extern char **environ;
+
 const char execdir[] = "exec/";
+int execdirfd = -1;
+int watchfd = -1;
+int zygotefd = -1;
+pid_t zygotepid;
+pid_t *zygotepids;
+bool fdschanged = true;
 const char killpipe[] = "kill";
 const char pidfile[] = "pid";
+const char starttimefile[] = "starttime";
 const char substfile[] = "subst";
+const char checkfile[] = "check";
+const char checkintervalfile[] = "checkinterval";
+const char checktimeoutfile[] = "checktimeout";
+const char checkthresholdfile[] = "checkthreshold";
+const char maxcpufile[] = "maxcpu";
+const char maxrssfile[] = "maxrss";
+const char usagefile[] = "usage";
+const char oneshotfile[] = "oneshot";
+const char statefile[] = "state";
+const char priorityfile[] = "priority";
+const char argsfile[] = "args";
+const char envdir[] = "env";
 
-Service *service(const char *name) {
+static const char *const statenames[] = {
+	[SERVICE_PENDING] = "pending",
+	[SERVICE_RUNNING] = "running",
+	[SERVICE_SUCCEEDED] = "succeeded",
+	[SERVICE_FAILED] = "failed",
+	[SERVICE_DOWN] = "down"
+};
+
+#ifndef CHECK_INTERVAL
+#define CHECK_INTERVAL 60
+#endif
+#ifndef CHECK_TIMEOUT
+#define CHECK_TIMEOUT 10
+#endif
+#ifndef CHECK_THRESHOLD
+#define CHECK_THRESHOLD 3
+#endif
+
+/* compiled once and reused by every spawn until something in the service
+ * directory changes, so restarts don't read any files
+ * argv, envp and their strings all live in the same allocation
+ */
+struct ServiceConfig {
+	unsigned long generation;
+	bool subst; // exec substfile rather than the one in execdir
+	char **argv;
+	char **envp;
+	char *ptrs[];
+};
+
+/* bumped when execdir changes, which makes every config stale */
+static unsigned long generation;
+
+static Table names, pids, watches;
+
+/* services waiting for their pid from the spawner, oldest first */
+static Service *requests[SPAWN_WINDOW];
+static unsigned requests_first, requests_len;
+
+/* pids of services in a list must only be changed through this */
+static void service_setpid(Service *self, pid_t *field, pid_t pid) {
+	if (self->prev && *field > 0) table_remove(&pids, *field, self);
+	*field = pid;
+	if (self->prev && pid > 0 && table_add(&pids, pid, self) < 0) {
+		SERVICE_LOG(self, "failed to index pid %li: %s!", (long)pid, err());
+	}
+}
+
+static void service_index(Service *self, bool add) {
+	size_t hash = table_hashstr(self->name);
+	pid_t pid[] = {self->pid, self->check.pid};
+	if (!add) {
+		table_remove(&names, hash, self);
+		for (size_t i = 0; i < lenof(pid); ++i) {
+			if (pid[i] > 0) table_remove(&pids, pid[i], self);
+		}
+		return;
+	}
+	bool ok = table_add(&names, hash, self) >= 0;
+	for (size_t i = 0; i < lenof(pid); ++i) {
+		if (pid[i] > 0) ok = table_add(&pids, pid[i], self) >= 0 && ok;
+	}
+	if (!ok) SERVICE_LOG(self, "failed to index: %s!", err());
+}
+
+static Service *service_alloc(const char *name) {
 	Service *self = malloc(sizeof(*self) + strlen(name) + 1);
 	if (!self) {
 		LOG("%s: malloc failed: %s", name, err());
 		return NULL;
 	}
 	self->next = NULL;
+	self->prev = NULL;
 	self->pid = 0;
+	self->pidfd = -1;
+	self->dirfd = -1;
+	self->killfd = -1;
+	self->killfdr = -1;
 	self->killbuf[0] = '\0';
+	self->oneshot = false;
+	self->down = false;
+	self->start = false;
+	self->state = SERVICE_PENDING;
+	self->priority = 0;
+	self->config = NULL;
+	self->wds[0] = self->wds[1] = -1;
+	self->check.interval = 0;
+	self->check.fails = 0;
+	self->check.pid = 0;
+	self->check.waiting = false;
+	self->check.next = NULL;
+	self->timer.index = 0;
+	self->queue.index = 0;
+	self->usage.fds[0] = self->usage.fds[1] = -1;
 	stpcpy(self->name, name);
-	mkdir(name, 0777);
+	return self;
+}
+
+Service *service(const char *name) {
+	Service *self = service_alloc(name);
+	if (!self) return NULL;
+	sys->mkdirat(AT_FDCWD, name, 0777);
+	self->dirfd = sys->openat(AT_FDCWD, name, O_DIRFD, 0);
+	if (self->dirfd < 0) {
+		SERVICE_LOG(self, "failed to open service directory: %s", err());
+	}
 
-	char path[snprintf(NULL, 0, "%s/%s", name, killpipe) + 1];
-	snprintf(path, sizeof(path), "%s/%s", name, killpipe);
-	mkfifo(path, 0777);
-	self->killfd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	sys->mkfifoat(self->dirfd, killpipe, 0777);
+	self->killfd = sys->openat(self->dirfd, killpipe,
+		O_RDONLY | O_NONBLOCK | O_CLOEXEC, 0
+	);
 	if (self->killfd >= 0) {
-		int flags = fcntl(self->killfd, F_GETFL);
+		int flags = sys->fcntl(self->killfd, F_GETFL, 0);
 		if (flags < 0 ||
-			fcntl(self->killfd, F_SETFL, flags | O_NONBLOCK) < 0 ||
-			(self->killfdr = open(path, O_WRONLY | O_CLOEXEC)) < 0
+			sys->fcntl(self->killfd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+			(self->killfdr = sys->openat(self->dirfd, killpipe,
+				O_WRONLY | O_CLOEXEC, 0
+			)) < 0
 		) {
-			close(self->killfd);
+			sys->close(self->killfd);
 			self->killfd = -1;
 		}
 	}
@@ -61,77 +203,674 @@ Service *service(const char *name) {
 void service_destroy(Service *self) {
 	while (self) {
 		Service *next = self->next;
+		if (self->prev) service_index(self, false);
+		service_invalidate(self);
+		for (size_t i = 0; i < lenof(self->wds); ++i) {
+			if (self->wds[i] < 0) continue;
+			table_remove(&watches, self->wds[i], self);
+			sys->unwatch(watchfd, self->wds[i]);
+		}
+		if (self->pidfd >= 0) sys->close(self->pidfd);
+		if (self->check.pid > 0) sys->kill(-self->check.pid, SIGKILL);
+		proc_closeusage(self->usage.fds);
 		if (self->killfd >= 0) {
-			close(self->killfd);
-			close(self->killfdr);
-		}
-		char path[strlen(self->name) + 1
-			+ MAX(sizeof(pidfile), sizeof(killpipe))
-		];
-		char *base = stpcpy(path, self->name);
-		*base++ = '/';
-		stpcpy(base, pidfile);
-		unlink(path);
-		stpcpy(base, killpipe);
-		unlink(path);
-		*base = '\0';
-		rmdir(path);
+			sys->close(self->killfd);
+			sys->close(self->killfdr);
+		}
+		if (self->dirfd >= 0) {
+			sys->unlinkat(self->dirfd, pidfile, 0);
+			sys->unlinkat(self->dirfd, starttimefile, 0);
+			sys->unlinkat(self->dirfd, usagefile, 0);
+			sys->unlinkat(self->dirfd, statefile, 0);
+			sys->unlinkat(self->dirfd, killpipe, 0);
+			sys->close(self->dirfd);
+		}
+		sys->unlinkat(AT_FDCWD, self->name, AT_REMOVEDIR);
 		free(self);
 		self = next;
 	}
 }
 
+/* replaces the contents of a file in the service directory */
+static int service_writefile(Service *self, const char *file,
+	const char *format, ...
+) {
+	char buf[64];
+	va_list ap;
+	va_start(ap, format);
+	int n = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	int fd = sys->openat(self->dirfd, file,
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777
+	);
+	if (fd < 0) return -1;
+	if (sys->write(fd, buf, MIN(n, (int)sizeof(buf) - 1)) < 0) n = -1;
+	sys->close(fd);
+	return n < 0 ? -1 : 0;
+}
+
 static void service_writepid(Service *self) {
-	int fd;
-	{
-		char path[snprintf(NULL, 0, "%s/%s", self->name, pidfile) + 1];
-		snprintf(path, sizeof(path), "%s/%s", self->name, pidfile);
-		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-	}
-	if (fd < 0 || dprintf(fd, "%li\n", (long)self->pid) < 0) {
+	if (service_writefile(self, pidfile, "%li\n", (long)self->pid) < 0) {
 		SERVICE_LOG(self, "failed to write pidfile: %s", err());
 	}
-	close(fd);
-}
-
-void service_spawn(Service *self) {
-	self->pid = -1;
-	char path[MAX(
-		snprintf(NULL, 0, "../%s/%s", self->name, substfile),
-		snprintf(NULL, 0, "../%s%s", execdir, self->name)
-	)];
-	snprintf(path, sizeof(path), "../%s/%s", self->name, substfile);
-	if (access(path + 1, X_OK) < 0) {
-		snprintf(path, sizeof(path), "../%s%s", execdir, self->name);
-		if (access(path + 1, X_OK) < 0) return;
-	}
-	self->pid = fork();
-	if (self->pid == 0) {
-		sigset_t sigmask;
-		errno = 0;
-		sigemptyset(&sigmask);
-		sigprocmask(SIG_SETMASK, &sigmask, NULL);
-		chdir(self->name);
-		setsid();
-		close(0);
-		close(1);
-		close(2);
-		if (errno) exit(125);
-		execv(path, (char *const []){(char *)self->name, NULL});
-		exit(127);
-	} else if (self->pid > 0) {
+
+	// lets a later instance of daemond tell our process from a recycled pid
+	unsigned long long starttime;
+	if (proc_starttime(self->pid, &starttime) < 0) {
+		sys->unlinkat(self->dirfd, starttimefile, 0);
+	} else if (service_writefile(self, starttimefile, "%llu\n",
+		starttime
+	) < 0) {
+		SERVICE_LOG(self, "failed to write starttime: %s", err());
+	}
+}
+
+/* reads up to n blank separated numbers from a file in the service directory
+ * returns how many were read, or -1 if the file is missing or malformed
+ */
+static int service_readuints(Service *self, const char *file,
+	uintmax_t max, uintmax_t *values, int n
+) {
+	char buf[64];
+	int fd = sys->openat(self->dirfd, file, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	ssize_t len = sys->read(fd, buf, sizeof(buf) - 1);
+	sys->close(fd);
+	if (len <= 0) return -1;
+	buf[len] = '\0';
+	char *p = buf;
+	int i = 0;
+	while (i < n) {
+		char *start = p;
+		values[i] = parseuint(&p, max, 10);
+		if (p == start) return -1;
+		++i;
+		if (*p != ' ' && *p != '\t') break;
+		while (*p == ' ' || *p == '\t') ++p;
+	}
+	if (*p && *p != '\n') return -1;
+	return i;
+}
+
+static int service_readuint(Service *self, const char *file,
+	uintmax_t max, uintmax_t *value
+) {
+	return service_readuints(self, file, max, value, 1) < 0 ? -1 : 0;
+}
+
+/* takes over the process recorded in the pidfile if it is still the one we
+ * (or a previous daemond) started, instead of starting a second instance
+ */
+int service_adopt(Service *self) {
+	uintmax_t pid, recorded;
+	unsigned long long starttime;
+	if (service_readuint(self, pidfile, LONG_MAX, &pid) < 0 || pid <= 1 ||
+		service_readuint(self, starttimefile, UINTMAX_MAX, &recorded) < 0
+	) return -1;
+	int pidfd = proc_pidfd(pid);
+	if (pidfd < 0) return -1;
+	// checked after opening the pidfd, so the pid can't be recycled under us
+	if (proc_starttime(pid, &starttime) < 0 || starttime != recorded) {
+		sys->close(pidfd);
+		return -1;
+	}
+	service_setpid(self, &self->pid, pid);
+	self->pidfd = pidfd;
+	SERVICE_LOG(self, "adopted");
+	service_setstate(self, SERVICE_RUNNING);
+	return 0;
+}
+
+/* soft and hard limit, the hard one defaults to none */
+static void service_readlimit(Service *self, const char *file,
+	unsigned long long limit[2]
+) {
+	uintmax_t values[2];
+	int n = service_readuints(self, file, ULLONG_MAX, values, 2);
+	limit[0] = n > 0 ? values[0] : 0;
+	limit[1] = n > 1 ? values[1] : 0;
+}
+
+typedef struct {
+	char *buf;
+	size_t len, cap;
+	size_t n; // strings
+} Strings;
+
+static int strings_add(Strings *s, const char *str, size_t len, bool end) {
+	if (s->len + len + 1 > s->cap) {
+		size_t cap = MAX(s->cap * 2, s->len + len + 1);
+		char *buf = realloc(s->buf, cap);
+		if (!buf) return -1;
+		s->buf = buf;
+		s->cap = cap;
+	}
+	memcpy(s->buf + s->len, str, len);
+	s->len += len;
+	if (end) {
+		s->buf[s->len++] = '\0';
+		++s->n;
+	}
+	return 0;
+}
+
+/* reads a whole file relative to dirfd, which is returned NUL terminated */
+static char *readall(int dirfd, const char *file, size_t *len) {
+	Strings s = {0};
+	char buf[4096];
+	ssize_t n;
+	int fd = sys->openat(dirfd, file, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return NULL;
+	while ((n = sys->read(fd, buf, sizeof(buf))) > 0) {
+		if (strings_add(&s, buf, n, false) < 0) break;
+	}
+	sys->close(fd);
+	if (n != 0 || strings_add(&s, "", 0, true) < 0) {
+		free(s.buf);
+		return NULL;
+	}
+	*len = s.len - 1;
+	return s.buf;
+}
+
+/* one argument per line of argsfile */
+static int service_readargs(Service *self, Strings *args) {
+	size_t len;
+	char *buf = readall(self->dirfd, argsfile, &len);
+	if (!buf) return errno == ENOENT ? 0 : -1;
+	int ret = 0;
+	for (char *p = buf; p < buf + len && ret >= 0;) {
+		size_t n = strcspn(p, "\n");
+		ret = strings_add(args, p, n, true);
+		p += n + 1;
+	}
+	free(buf);
+	return ret;
+}
+
+/* like envdir: each file in envdir sets the variable it is named after to its
+ * first line without trailing blanks, with NUL read as newline
+ * empty files unset the variable, and are kept as just the name
+ */
+static int service_readenv(Service *self, Strings *env) {
+	int fd = sys->openat(self->dirfd, envdir,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0
+	);
+	void *dir = fd < 0 ? NULL : sys->opendir(fd);
+	if (!dir) {
+		if (fd >= 0) sys->close(fd);
+		return errno == ENOENT ? 0 : -1;
+	}
+	const char *name;
+	int ret = 0;
+	while (ret >= 0 && (name = sys->readdir(dir))) {
+		if (*name == '.' || strchr(name, '=')) continue;
+		size_t len;
+		char *buf = readall(fd, name, &len);
+		if (!buf) {
+			// directories and files removed under us
+			if (errno == EISDIR || errno == ENOENT) continue;
+			ret = -1;
+			break;
+		}
+		char *nl = memchr(buf, '\n', len);
+		if (nl) len = nl - buf;
+		while (len && (buf[len - 1] == ' ' || buf[len - 1] == '\t')) --len;
+		for (size_t i = 0; i < len; ++i) if (!buf[i]) buf[i] = '\n';
+		ret = strings_add(env, name, strlen(name), !len);
+		if (ret >= 0 && len) {
+			ret = strings_add(env, "=", 1, false);
+			if (ret >= 0) ret = strings_add(env, buf, len, true);
+		}
+		free(buf);
+	}
+	sys->closedir(dir);
+	sys->close(fd);
+	return ret;
+}
+
+/* whether NAME=... in environ is overridden or unset by env */
+static bool service_envhas(const Strings *env, const char *var) {
+	size_t n = strcspn(var, "=");
+	const char *end = env->buf + env->len;
+	for (const char *p = env->buf; p < end; p += strlen(p) + 1) {
+		if (strncmp(p, var, n) == 0 && (p[n] == '=' || p[n] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* watches are set up before reading, so no change can be missed */
+static void service_watch(Service *self) {
+	if (watchfd < 0) return;
+	// relative to the working directory, like the service directory itself
+	char path[strlen(self->name) + sizeof(envdir) + 1];
+	const char *paths[] = {self->name, path};
+	snprintf(path, sizeof(path), "%s/%s", self->name, envdir);
+	for (size_t i = 0; i < lenof(self->wds); ++i) {
+		if (self->wds[i] >= 0) continue;
+		self->wds[i] = sys->watch(watchfd, paths[i]);
+		if (self->wds[i] >= 0 && table_add(&watches, self->wds[i], self) < 0) {
+			sys->unwatch(watchfd, self->wds[i]);
+			self->wds[i] = -1;
+		}
+	}
+}
+
+static ServiceConfig *service_compile(Service *self) {
+	ServiceConfig *config = NULL;
+	Strings args = {0}, env = {0};
+	service_watch(self);
+	bool subst = sys->faccessat(self->dirfd, substfile, X_OK, 0) >= 0;
+	if (!subst && sys->faccessat(execdirfd, self->name, X_OK, 0) < 0) {
+		return NULL;
+	}
+	if (strings_add(&args, self->name, strlen(self->name), true) < 0 ||
+		service_readargs(self, &args) < 0 || service_readenv(self, &env) < 0
+	) {
+		SERVICE_LOG(self, "failed to read configuration: %s!", err());
+		goto out;
+	}
+
+	size_t nenv = 0;
+	for (char **var = environ; *var; ++var) {
+		if (!service_envhas(&env, *var)) ++nenv;
+	}
+	size_t nptrs = args.n + 1 + nenv + env.n + 1;
+	config = malloc(sizeof(*config) + nptrs * sizeof(char *) +
+		args.len + env.len
+	);
+	if (!config) {
+		SERVICE_LOG(self, "malloc failed: %s", err());
+		goto out;
+	}
+	config->generation = generation;
+	config->subst = subst;
+	config->argv = config->ptrs;
+	config->envp = config->ptrs + args.n + 1;
+	char **ptr = config->ptrs;
+	char *str = (char *)(config->ptrs + nptrs);
+	memcpy(str, args.buf, args.len);
+	for (char *end = str + args.len; str < end; str += strlen(str) + 1) {
+		*ptr++ = str;
+	}
+	*ptr++ = NULL;
+	for (char **var = environ; *var; ++var) {
+		if (!service_envhas(&env, *var)) *ptr++ = *var;
+	}
+	memcpy(str, env.buf, env.len);
+	for (char *end = str + env.len; str < end; str += strlen(str) + 1) {
+		if (strchr(str, '=')) *ptr++ = str;
+	}
+	*ptr = NULL;
+
+out:
+	free(args.buf);
+	free(env.buf);
+	return config;
+}
+
+/* NULL for all services */
+void service_invalidate(Service *self) {
+	if (!self) {
+		++generation;
+	} else {
+		free(self->config);
+		self->config = NULL;
+	}
+}
+
+/* reads settings only if they might have changed since they were compiled,
+ * which is always without a watch on the service directory
+ */
+void service_configure(Service *self) {
+	uintmax_t i;
+	// a chmod in execdir changes neither its mtime nor anything watched
+	if (self->config && self->wds[0] >= 0 &&
+		self->config->generation == generation && (self->config->subst ||
+			sys->faccessat(execdirfd, self->name, X_OK, 0) >= 0
+		)
+	) return;
+	service_invalidate(self);
+	self->config = service_compile(self);
+
+	service_readlimit(self, maxrssfile, self->usage.maxrss);
+	service_readlimit(self, maxcpufile, self->usage.maxcpu);
+	self->oneshot = sys->faccessat(self->dirfd, oneshotfile, F_OK, 0) >= 0;
+	self->priority = 0;
+	if (service_readuint(self, priorityfile, UINT_MAX, &i) >= 0) {
+		self->priority = i;
+	}
+
+	self->check.interval = 0;
+	if (sys->faccessat(self->dirfd, checkfile, X_OK, 0) < 0) return;
+	self->check.interval = CHECK_INTERVAL;
+	self->check.timeout = CHECK_TIMEOUT;
+	self->check.threshold = CHECK_THRESHOLD;
+	if (service_readuint(self, checkintervalfile, UINT_MAX, &i) >= 0) {
+		self->check.interval = MAX(i, 1);
+	}
+	if (service_readuint(self, checktimeoutfile, UINT_MAX, &i) >= 0) {
+		self->check.timeout = MAX(i, 1);
+	}
+	if (service_readuint(self, checkthresholdfile, UINT_MAX, &i) >= 0) {
+		self->check.threshold = MAX(i, 1);
+	}
+}
+
+/* the rest of spawning once the pid is known */
+static void service_forked(Service *self, pid_t pid) {
+	service_setpid(self, &self->pid, pid);
+	if (self->pid > 0) {
 		SERVICE_LOG(self, "forked");
 		service_writepid(self);
+		service_setstate(self, SERVICE_RUNNING);
 	} else {
 		SERVICE_LOG(self, "fork failed: %s", err());
+		service_setstate(self, SERVICE_FAILED);
 	}
+	TRACE2(spawn_done, self->name, self->pid);
 }
 
-/* return >0 - valid signal
- * return =0 - invalid signal
- * return <0 - no signal available
+static void service_fork(Service *self) {
+	ServiceConfig *config = self->config;
+	pid_t pid = sys->fork();
+	if (pid == 0) {
+		if (config->subst) {
+			spawn_exec(self->dirfd, self->dirfd, substfile,
+				config->argv, config->envp
+			);
+		}
+		spawn_exec(self->dirfd, execdirfd, self->name,
+			config->argv, config->envp
+		);
+	}
+	service_forked(self, pid);
+}
+
+/* the spawner is stopped for good, so it can't fork anything more behind our
+ * back and the pids recorded for outstanding requests are final
+ */
+static void service_zygotefailed(void) {
+	LOG("spawner failed: %s, forking directly!", err());
+	sys->close(zygotefd);
+	zygotefd = -1;
+	if (zygotepid > 0) {
+		sys->kill(zygotepid, SIGKILL);
+		sys->waitpid(zygotepid, NULL, 0);
+		zygotepid = 0;
+	}
+}
+
+/* returns false if the pid comes later from service_spawned */
+bool service_spawn(Service *self) {
+	TRACE1(spawn_start, self->name);
+	if (self->pidfd >= 0) {
+		sys->close(self->pidfd);
+		self->pidfd = -1;
+		fdschanged = true;
+	}
+	service_setpid(self, &self->pid, -1);
+	service_configure(self);
+	ServiceConfig *config = self->config;
+	if (!config) {
+		service_setstate(self, SERVICE_FAILED);
+		TRACE2(spawn_done, self->name, -1);
+		return true;
+	}
+	self->check.fails = 0;
+	proc_closeusage(self->usage.fds);
+	self->usage.time = (struct timespec){0};
+	self->usage.cpu = 0;
+	self->usage.rss = 0;
+	self->usage.sig = 0;
+	// the spawner resolves paths relative to the same working directory
+	if (zygotefd >= 0 && requests_len < SPAWN_WINDOW) {
+		unsigned slot = (requests_first + requests_len) % SPAWN_WINDOW;
+		zygotepids[slot] = 0;
+		requests[slot] = self;
+		++requests_len;
+		if (spawn_request(zygotefd, slot, self->name,
+			config->subst ? self->name : execdir,
+			config->subst ? substfile : self->name,
+			config->argv, config->envp
+		) >= 0) return false;
+		// settled by service_spawned like the others that are outstanding
+		service_zygotefailed();
+		return false;
+	}
+	service_fork(self);
+	return true;
+}
+
+/* finishes the oldest request to the spawner and returns its service, if
+ * there is one and wait is set or there is no room for another request
+ */
+Service *service_spawned(bool wait) {
+	if (!requests_len || (!wait && requests_len < SPAWN_WINDOW)) return NULL;
+	unsigned slot = requests_first;
+	Service *self = requests[slot];
+	requests_first = (requests_first + 1) % SPAWN_WINDOW;
+	--requests_len;
+	pid_t pid;
+	if (zygotefd >= 0 && spawn_reply(zygotefd, &pid) >= 0) {
+		service_forked(self, pid);
+		return self;
+	}
+	if (zygotefd >= 0) service_zygotefailed();
+	// it may have died between forking and replying
+	if (zygotepids[slot] > 0) {
+		service_forked(self, zygotepids[slot]);
+	} else {
+		service_fork(self);
+	}
+	return self;
+}
+
+/* files daemond writes itself, which don't change the configuration */
+static bool service_ownfile(const char *file) {
+	const char *const files[] = {killpipe, pidfile, starttimefile, usagefile,
+		statefile
+	};
+	for (size_t i = 0; i < lenof(files); ++i) {
+		if (strcmp(file, files[i]) == 0) return true;
+	}
+	return false;
+}
+
+/* drains watchfd and invalidates the configs of services whose directories
+ * changed, they are compiled again by the next spawn. daemond writes to them
+ * as well, so this is called before spawning rather than woken up for
  */
-static int service_readkill(Service *self) {
+void service_handlewatch(void) {
+#ifdef __linux__
+	union {
+		struct inotify_event e; // for alignment
+		char buf[4096];
+	} u;
+	ssize_t len;
+	while ((len = sys->read(watchfd, u.buf, sizeof(u.buf))) > 0) {
+		for (char *p = u.buf; p < u.buf + len;) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			p += sizeof(*e) + e->len;
+			if (e->mask & IN_Q_OVERFLOW) service_invalidate(NULL);
+			size_t i = 0;
+			Service *self;
+			while ((self = table_next(&watches, e->wd, &i))) {
+				if (self->wds[0] == e->wd || self->wds[1] == e->wd) break;
+			}
+			if (!self) continue;
+			bool dir = self->wds[0] == e->wd;
+			if (e->mask & IN_IGNORED) {
+				// the directory is gone, watched again once it is back
+				table_remove(&watches, e->wd, self);
+				self->wds[!dir] = -1;
+			} else if (dir && e->len && service_ownfile(e->name)) {
+				continue;
+			}
+			service_invalidate(self);
+		}
+	}
+#endif
+}
+
+/* the state file is rewritten in place so watchers of it keep working */
+void service_setstate(Service *self, int state) {
+	self->state = state;
+	if (service_writefile(self, statefile, "%s\n", statenames[state]) < 0) {
+		SERVICE_LOG(self, "failed to write state: %s", err());
+	}
+	if (state != SERVICE_PENDING && state != SERVICE_RUNNING) {
+		SERVICE_LOG(self, "%s", statenames[state]);
+	}
+}
+
+/* forgets the process once it is gone, the state is up to the caller */
+void service_stopped(Service *self) {
+	if (self->pidfd >= 0) {
+		sys->close(self->pidfd);
+		self->pidfd = -1;
+		fdschanged = true;
+	}
+	proc_closeusage(self->usage.fds);
+	service_setpid(self, &self->pid, 0);
+}
+
+void service_check(Service *self) {
+	char *const argv[] = {(char *)checkfile, NULL};
+	char *const *envp = self->config ? self->config->envp : environ;
+	pid_t pid = 0;
+	// checks run between batches of spawns, so the reply is next
+	if (zygotefd >= 0 && !requests_len) {
+		unsigned slot = requests_first;
+		zygotepids[slot] = 0;
+		if (spawn_request(zygotefd, slot, self->name, self->name, checkfile,
+				argv, envp
+			) < 0 || spawn_reply(zygotefd, &pid) < 0
+		) {
+			service_zygotefailed();
+			pid = zygotepids[slot];
+		}
+	}
+	if (!pid) {
+		pid = sys->fork();
+		if (pid == 0) {
+			spawn_exec(self->dirfd, self->dirfd, checkfile, argv, envp);
+		}
+	}
+	service_setpid(self, &self->check.pid, pid);
+	if (self->check.pid < 0) {
+		SERVICE_LOG(self, "check fork failed: %s", err());
+		service_setpid(self, &self->check.pid, 0);
+	}
+}
+
+void service_checktimeout(Service *self) {
+	SERVICE_LOG(self, "check timed out");
+	sys->kill(-self->check.pid, SIGKILL); // its whole session
+}
+
+/* the instance it checks is gone, so its result wouldn't mean anything */
+void service_uncheck(Service *self) {
+	sys->kill(-self->check.pid, SIGKILL);
+	service_setpid(self, &self->check.pid, 0);
+}
+
+/* returns true if the service was told to restart */
+bool service_checked(Service *self, int status) {
+	service_setpid(self, &self->check.pid, 0);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		self->check.fails = 0;
+		return false;
+	}
+	++self->check.fails;
+	SERVICE_LOG(self, "check failed (%u/%u)",
+		self->check.fails, self->check.threshold
+	);
+	if (self->check.fails < self->check.threshold || self->pid <= 0) {
+		return false;
+	}
+	self->check.fails = 0;
+	if (sys->kill(self->pid, SIGTERM) < 0) {
+		SERVICE_LOG(self, "failed to restart unhealthy service: %s", err());
+		return false;
+	}
+	SERVICE_LOG(self, "unhealthy, restarting!");
+	return true;
+}
+
+static void service_writeusage(Service *self) {
+	if (service_writefile(self, usagefile, "%u %llu\n",
+		self->usage.cpu, self->usage.rss
+	) < 0) {
+		SERVICE_LOG(self, "failed to write usage: %s", err());
+	}
+}
+
+static bool service_overlimit(Service *self, int hard) {
+	return (self->usage.maxrss[hard] &&
+		self->usage.rss > self->usage.maxrss[hard]
+	) || (self->usage.maxcpu[hard] &&
+		self->usage.cpu > self->usage.maxcpu[hard]
+	);
+}
+
+/* samples cpu and memory usage at monotonic time t, and restarts the service
+ * if it is over its limits: gracefully for the soft ones, with SIGKILL for the
+ * hard ones
+ */
+void service_sample(Service *self, struct timespec t) {
+	unsigned long long cputime, rss;
+	unsigned cpu = self->usage.cpu;
+	if (self->pid <= 0) return;
+	if (self->usage.fds[0] < 0 &&
+		proc_openusage(self->pid, self->usage.fds) < 0
+	) {
+		// once, as it most likely fails for every service, e.g. with EMFILE
+		static bool logged;
+		if (!logged && errno != ENOENT) {
+			SERVICE_LOG(self, "failed to open usage: %s", err());
+			logged = true;
+		}
+		return;
+	}
+	if (proc_usage(self->usage.fds, &cputime, &rss) < 0) {
+		return; // exited, will be reaped
+	}
+	bool first = !self->usage.time.tv_sec && !self->usage.time.tv_nsec;
+	if (!first) {
+		long long ms = (t.tv_sec - self->usage.time.tv_sec) * 1000LL
+			+ (t.tv_nsec - self->usage.time.tv_nsec) / 1000000;
+		if (ms > 0) {
+			self->usage.cpu = (cputime - self->usage.cputime) * 100 / ms;
+		}
+	}
+	self->usage.cputime = cputime;
+	self->usage.time = t;
+	// mostly idle services would otherwise have it rewritten on every sample
+	if (first || self->usage.cpu != cpu || self->usage.rss != rss) {
+		self->usage.rss = rss;
+		service_writeusage(self);
+	}
+
+	int sig = service_overlimit(self, 1) ? SIGKILL :
+		service_overlimit(self, 0) ? SIGTERM : 0;
+	if (!sig || self->usage.sig == sig || self->usage.sig == SIGKILL) return;
+	self->usage.sig = sig;
+	if (sys->kill(self->pid, sig) < 0) {
+		SERVICE_LOG(self, "failed to restart service over limit: %s", err());
+	} else {
+		SERVICE_LOG(self, "cpu %u%% rss %lluKiB over %s limit, restarting!",
+			self->usage.cpu, self->usage.rss, sig == SIGKILL ? "hard" : "soft"
+		);
+	}
+}
+
+/* reads the next line from the killpipe into cmd, which is left empty if the
+ * line was too long, returns -1 when there are no more complete lines
+ */
+static int service_readkill(Service *self, char *cmd) {
 	char *delim, *pos = self->killbuf;
 	ssize_t n = strnlen(pos, lenof(self->killbuf));
 	bool overflow = false;
@@ -143,63 +882,218 @@ static int service_readkill(Service *self) {
 		} else if (!overflow) {
 			*pos = '\0';
 		}
-		n = read(self->killfd, pos, endof(self->killbuf) - pos);
+		n = sys->read(self->killfd, pos, endof(self->killbuf) - pos);
 		if (n <= 0) return -1;
 		char *c = pos + n;
 		while (c-- > pos) if (!*c) *c = '?'; // neutralize NUL chars
 	}
 	*delim++ = '\0';
-	int sig = overflow ? 0 : getsignal(self->killbuf);
+	strcpy(cmd, overflow ? "" : self->killbuf);
 	n += pos - delim;
 	memmove(self->killbuf, delim, n);
 	self->killbuf[n] = '\0';
-	return sig;
+	return 0;
 }
 
+/* commands are signal names, or up, down and restart
+ * the latter only set down and start, the main loop starts services
+ */
 void service_handlekill(Service *self) {
-	int sig;
-	while ((sig = service_readkill(self)) >= 0) {
-		if (sig > 0) {
-			const char *str = strsignal(sig);
-			if (kill(self->pid, sig) >= 0) {
-				SERVICE_LOG(self, "sent signal %s[%i]", str, sig);
-			} else {
-				SERVICE_LOG(self, "failed to send signal %s[%i]: %s",
-					str, sig, err()
-				);
-			}
+	char cmd[lenof(self->killbuf)];
+	while (service_readkill(self, cmd) >= 0) {
+		int sig = SIGTERM;
+		TRACE3(command, self->name, self->pid, cmd);
+		if (strcmp(cmd, "up") == 0) {
+			self->down = false;
+			self->start = self->pid <= 0 && self->state != SERVICE_PENDING;
+			continue;
+		} else if (strcmp(cmd, "down") == 0) {
+			self->down = true;
+			self->start = false;
+			if (self->pid <= 0) continue;
+		} else if (strcmp(cmd, "restart") == 0) {
+			self->down = false;
+			self->start = true;
+			if (self->pid <= 0) continue;
+		} else if (!(sig = getsignal(cmd))) {
+			SERVICE_LOG(self, "invalid command!");
+			continue;
+		} else if (self->pid <= 0) {
+			SERVICE_LOG(self, "not running, ignoring signal!");
+			continue;
+		}
+		if (sys->kill(self->pid, sig) >= 0) {
+			SERVICE_LOG(self, "sent signal %s[%i]", strsignal(sig), sig);
 		} else {
-			SERVICE_LOG(self, "invalid signal!");
+			SERVICE_LOG(self, "failed to send signal %s[%i]: %s",
+				strsignal(sig), sig, err()
+			);
+		}
+	}
+}
+
+/* handoff format: one record per service, each field NUL terminated
+ * name, then key=value fields, then an empty field
+ * unknown keys are ignored so the format can grow between versions
+ */
+int service_save(Service *list, int fd) {
+	FILE *f = fdopen(dup(fd), "w");
+	if (!f) return -1;
+	for (Service *self = list; self; self = self->next) {
+		fprintf(f, "%s%cpid=%li%c", self->name, 0, (long)self->pid, 0);
+		if (self->pidfd >= 0) fprintf(f, "pidfd=%i%c", self->pidfd, 0);
+		if (self->dirfd >= 0) fprintf(f, "dirfd=%i%c", self->dirfd, 0);
+		if (self->check.pid > 0) {
+			fprintf(f, "checkpid=%li%c", (long)self->check.pid, 0);
+		}
+		if (self->check.fails) {
+			fprintf(f, "checkfails=%u%c", self->check.fails, 0);
+		}
+		fprintf(f, "state=%s%c", statenames[self->state], 0);
+		if (self->down) fprintf(f, "down=1%c", 0);
+		if (self->killfd >= 0) {
+			fprintf(f, "killfd=%i%ckillfdr=%i%ckillbuf=%.*s%c",
+				self->killfd, 0, self->killfdr, 0,
+				(int)strnlen(self->killbuf, lenof(self->killbuf)),
+				self->killbuf, 0
+			);
 		}
+		fputc(0, f);
 	}
+	return fclose(f);
 }
 
-Service **service_from_name(Service **list, const char *name) {
-	while (*list) {
-		if (strcmp((*list)->name, name) == 0) break;
-		list = &(*list)->next;
+static int service_loadfd(char *value) {
+	int fd = parseuint(&value, INT_MAX, 10);
+	if (*value || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) return -1;
+	return fd;
+}
+
+int service_load(Service **list, int fd) {
+	struct stat st;
+	if (fstat(fd, &st) < 0) return -1;
+	char *buf = malloc(st.st_size + 1);
+	if (!buf) return -1;
+	off_t len = 0;
+	while (len < st.st_size) {
+		ssize_t n = pread(fd, buf + len, st.st_size - len, len);
+		if (n <= 0) break;
+		len += n;
 	}
-	return list;
+	buf[len] = '\0';
+
+	Service **tail = list;
+	while (*tail) tail = &(*tail)->next;
+	for (char *p = buf; p < buf + len;) {
+		Service *self = service_alloc(p);
+		p += strlen(p) + 1;
+		for (; p < buf + len && *p; p += strlen(p) + 1) {
+			char *value = strchr(p, '=');
+			if (!self || !value) continue;
+			*value++ = '\0';
+			if (strcmp(p, "pid") == 0) {
+				self->pid = parseuint(&value, LONG_MAX, 10);
+			} else if (strcmp(p, "pidfd") == 0) {
+				self->pidfd = service_loadfd(value);
+			} else if (strcmp(p, "dirfd") == 0) {
+				self->dirfd = service_loadfd(value);
+			} else if (strcmp(p, "killfd") == 0) {
+				self->killfd = service_loadfd(value);
+			} else if (strcmp(p, "killfdr") == 0) {
+				self->killfdr = service_loadfd(value);
+			} else if (strcmp(p, "killbuf") == 0) {
+				// only terminated if it isn't full, see service_readkill
+				size_t n = strnlen(value, lenof(self->killbuf));
+				memcpy(self->killbuf, value, n);
+				if (n < lenof(self->killbuf)) self->killbuf[n] = '\0';
+			} else if (strcmp(p, "checkpid") == 0) {
+				self->check.pid = parseuint(&value, LONG_MAX, 10);
+			} else if (strcmp(p, "checkfails") == 0) {
+				self->check.fails = parseuint(&value, UINT_MAX, 10);
+			} else if (strcmp(p, "down") == 0) {
+				self->down = true;
+			} else if (strcmp(p, "state") == 0) {
+				for (size_t i = 0; i < lenof(statenames); ++i) {
+					if (strcmp(value, statenames[i]) == 0) self->state = i;
+				}
+			}
+			p = value; // skip key=
+		}
+		++p;
+		if (!self) continue;
+		if (self->dirfd < 0) self->dirfd = open(self->name, O_DIRFD);
+		service_configure(self);
+		if ((self->killfd < 0) != (self->killfdr < 0)) {
+			if (self->killfd >= 0) close(self->killfd);
+			if (self->killfdr >= 0) close(self->killfdr);
+			self->killfd = self->killfdr = -1;
+		}
+		service_insert(tail, self);
+		tail = &self->next;
+	}
+	free(buf);
+	return 0;
 }
 
-Service **service_from_pid(Service **list, pid_t pid) {
-	while (*list) {
-		if ((*list)->pid == pid) break;
-		list = &(*list)->next;
+void service_inherit(Service *list, bool inherit) {
+	for (Service *self = list; self; self = self->next) {
+		if (self->pidfd >= 0) {
+			fcntl(self->pidfd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+		}
+		if (self->dirfd >= 0) {
+			fcntl(self->dirfd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+		}
+		if (self->killfd < 0) continue;
+		fcntl(self->killfd, F_SETFD, inherit ? 0 : FD_CLOEXEC);
+		fcntl(self->killfdr, F_SETFD, inherit ? 0 : FD_CLOEXEC);
 	}
-	return list;
+}
+
+Service *service_from_name(const char *name) {
+	size_t i = 0, hash = table_hashstr(name);
+	Service *self;
+	while ((self = table_next(&names, hash, &i))) {
+		if (strcmp(self->name, name) == 0) break;
+	}
+	return self;
+}
+
+Service *service_from_pid(pid_t pid) {
+	size_t i = 0;
+	Service *self;
+	while ((self = table_next(&pids, pid, &i))) {
+		if (self->pid == pid) break;
+	}
+	return self;
+}
+
+Service *service_from_checkpid(pid_t pid) {
+	size_t i = 0;
+	Service *self;
+	while ((self = table_next(&pids, pid, &i))) {
+		if (self->check.pid == pid) break;
+	}
+	return self;
 }
 
 void service_insert(Service **pos, Service *element) {
-	if (element) element->next = *pos;
+	if (!element) return;
+	element->next = *pos;
+	if (*pos) (*pos)->prev = &element->next;
+	element->prev = pos;
 	*pos = element;
+	service_index(element, true);
 }
 
 Service *service_delete(Service **pos) {
 	Service *element = *pos;
 	if (element) {
+		service_index(element, false);
 		*pos = element->next;
+		if (*pos) (*pos)->prev = pos;
 		element->next = NULL;
+		element->prev = NULL;
+		fdschanged = true;
 	}
 	return element;
 }
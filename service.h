@@ -1,30 +1,115 @@
+#include <stdbool.h>
+#include <time.h>
+
 #include <sys/types.h>
 
 typedef struct Service Service;
+typedef struct ServiceConfig ServiceConfig;
+
+/* written to the state file, one-shot services go through all of them */
+enum {SERVICE_PENDING, SERVICE_RUNNING, SERVICE_SUCCEEDED, SERVICE_FAILED,
+	SERVICE_DOWN
+};
 
 struct Service {
 	Service *next;
+	Service **prev; // the pointer to this, NULL when not in a list
 	pid_t pid;
+	int pidfd; // only for adopted processes, which waitpid can't see
+	int dirfd; // service directory
 	int killfd;
 	int killfdr;
-	char killbuf[SIGNAMELEN];
+	char killbuf[SIGNAMELEN > 8 ? SIGNAMELEN : 8]; // fits "restart\n"
+	bool oneshot; // run once rather than restarted
+	bool down; // told to stay down
+	bool start; // told to start once it is not running
+	int state;
+	unsigned priority; // higher is spawned first
+	ServiceConfig *config; // compiled by service_configure, NULL if stale
+	int wds[2]; // watches on the service directory and env/
+	struct {
+		unsigned interval; // seconds, 0 if there is no check
+		unsigned timeout; // seconds
+		unsigned threshold; // failures in a row before restarting
+		unsigned fails;
+		pid_t pid;
+		bool waiting; // in the list of those waiting for a free check slot
+		Service *next;
+	} check;
+	struct {
+		int fds[2]; // see proc_openusage
+		struct timespec time; // of the last sample
+		unsigned long long cputime; // ms at the last sample
+		unsigned cpu; // percent of one cpu since the last sample
+		unsigned long long rss; // KiB
+		unsigned long long maxcpu[2]; // soft and hard limit, 0 for none
+		unsigned long long maxrss[2];
+		int sig; // last signal sent for going over a limit
+	} usage;
+	HeapNode timer; // scheduled by the main loop
+	struct timespec due;
+	HeapNode queue; // waiting to be spawned
+	unsigned long long queued; // orders equal priorities
+
 	char name[];
 };
 
 extern const char execdir[];
+extern int execdirfd;
+extern int watchfd; // changes in service directories, see service_handlewatch
+extern int zygotefd; // spawns go through the spawner if set, see spawn.h
+extern pid_t zygotepid; // the spawner, 0 once it is reaped
+extern pid_t *zygotepids; // recorded for each request, see spawn.h
+extern bool fdschanged; // a service was unlisted or its pidfd closed
 
 /* service directory */
 extern const char killpipe[];
 extern const char pidfile[];
+extern const char starttimefile[];
 extern const char substfile[];
+extern const char checkfile[];
+extern const char checkintervalfile[];
+extern const char checktimeoutfile[];
+extern const char checkthresholdfile[];
+extern const char maxcpufile[];
+extern const char maxrssfile[];
+extern const char usagefile[];
+extern const char oneshotfile[];
+extern const char statefile[];
+extern const char priorityfile[];
+extern const char argsfile[];
+extern const char envdir[];
 
 Service *service(const char *name);
 void service_destroy(Service *self);
-void service_spawn(Service *self);
+int service_adopt(Service *self);
+void service_configure(Service *self);
+void service_invalidate(Service *self);
+void service_handlewatch(void);
+bool service_spawn(Service *self);
+Service *service_spawned(bool wait);
+void service_setstate(Service *self, int state);
+void service_stopped(Service *self);
 void service_handlekill(Service *self);
 
-/* list functions */
-Service **service_from_name(Service **pos, const char *name);
-Service **service_from_pid(Service **pos, pid_t pid);
+/* health checks */
+void service_check(Service *self);
+void service_checktimeout(Service *self);
+void service_uncheck(Service *self);
+bool service_checked(Service *self, int status);
+
+void service_sample(Service *self, struct timespec t);
+
+/* handoff of the service table across exec */
+int service_save(Service *list, int fd);
+int service_load(Service **list, int fd);
+void service_inherit(Service *list, bool inherit);
+
+/* list functions
+ * services in a list are indexed by name and pids, so one list is expected
+ */
+Service *service_from_name(const char *name);
+Service *service_from_pid(pid_t pid);
+Service *service_from_checkpid(pid_t pid);
 void service_insert(Service **pos, Service *element);
 Service *service_delete(Service **pos);
@@ -0,0 +1,530 @@
+/* sim - simulated operating system for testing the supervisor at scale
+ * nothing is forked and no files are touched. a script on stdin drives a fake
+ * clock, fake children and the service tree, with one event per line:
+ *   <seconds> services <n> [oneshot] n more services, named s0, s1...
+ *   <seconds> exit <name> <code>     the process of a service exits
+ *   <seconds> signal <name> <signal> the process of a service is killed
+ *   <seconds> crash <n>              n random services exit with code 1
+ *   <seconds> control <name> <line>  written to the killpipe of a service
+ *   <seconds> priority <name> <n>    written to the priority file of a service
+ *   <seconds> end                    daemond is sent SIGTERM
+ * lines must be sorted by time. a summary is written to stderr at exit
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "getsignal.h"
+#include "heap.h"
+#include "service.h"
+#include "sys.h"
+#include "sim.h"
+#include "util.h"
+
+#define SIM_FD 1024 // fake fds start here, the ones below are real
+#define SIM_PID 2
+
+/* the encoding of wait statuses is not specified, this is the traditional
+ * one that most systems use
+ */
+#define SIM_EXITED(code) (((code) & 0xff) << 8)
+#define SIM_SIGNALED(sig) ((sig) & 0x7f)
+
+typedef struct SimService SimService;
+typedef struct SimChild SimChild;
+typedef struct SimFd SimFd;
+typedef struct SimEvent SimEvent;
+
+struct SimService {
+	pid_t pid; // 0 if not running
+	bool oneshot;
+	unsigned priority; // 0 if there is no priority file
+	char *killbuf; // unread killpipe contents
+	size_t killlen;
+};
+
+struct SimChild {
+	int srv; // known once its pidfile is written, -1 before
+	bool alive;
+};
+
+struct SimFd {
+	enum {SIM_FREE, SIM_EXECDIR, SIM_DIR, SIM_KILLR, SIM_KILLW, SIM_FILE,
+		SIM_PIDFILE, SIM_PRIORITY
+	} kind;
+	int srv;
+};
+
+struct SimEvent {
+	struct timespec time;
+	char *line; // after the time
+};
+
+static struct timespec simtime;
+static struct timespec mtime; // of execdir
+static SimService *simservices;
+static size_t nservices;
+static SimChild *children;
+static size_t nchildren;
+static int *zombies; // pid and status pairs, in exit order
+static size_t zombies_head, zombies_len, zombies_cap;
+static SimFd *fds;
+static size_t nfds;
+static int freefd = -1; // closed fds are linked through srv
+static SimEvent *events;
+static size_t nevents, nextevent;
+static struct {
+	unsigned long polls, forks, reaps, signals, commands;
+} stats;
+static struct timespec started;
+
+static void *sim_grow(void *array, size_t *cap, size_t len, size_t size) {
+	if (len < *cap) return array;
+	size_t newcap = MAX(*cap * 2, 64);
+	void *p = realloc(array, newcap * size);
+	if (!p) DIE("simulation out of memory!");
+	*cap = newcap;
+	return p;
+}
+
+static bool sim_before(struct timespec a, struct timespec b) {
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static int sim_service(const char *name) {
+	char *p = (char *)name + 1;
+	if (*name != 's' || !*p) return -1;
+	uintmax_t i = parseuint(&p, SIZE_MAX, 10);
+	if (*p || i >= nservices) return -1;
+	return i;
+}
+
+static SimFd *sim_fd(int fd) {
+	if (fd < SIM_FD || (size_t)(fd - SIM_FD) >= nfds) return NULL;
+	SimFd *f = &fds[fd - SIM_FD];
+	return f->kind == SIM_FREE ? NULL : f;
+}
+
+static int sim_newfd(SimFd fd) {
+	static size_t cap;
+	size_t i = freefd;
+	if (freefd >= 0) {
+		freefd = fds[i].srv;
+	} else {
+		fds = sim_grow(fds, &cap, nfds, sizeof(*fds));
+		i = nfds++;
+	}
+	fds[i] = fd;
+	return SIM_FD + i;
+}
+
+static void sim_terminate(pid_t pid, int status) {
+	SimChild *child = &children[pid - SIM_PID];
+	child->alive = false;
+	if (child->srv >= 0 && simservices[child->srv].pid == pid) {
+		simservices[child->srv].pid = 0;
+	}
+	if (zombies_head && zombies_head == zombies_len) {
+		zombies_head = zombies_len = 0;
+	}
+	zombies = sim_grow(zombies, &zombies_cap, zombies_len + 1, sizeof(*zombies));
+	zombies[zombies_len++] = pid;
+	zombies[zombies_len++] = status;
+}
+
+static void sim_event(char *line) {
+	char *cmd = strtok(line, " \t\n");
+	char *arg = strtok(NULL, " \t\n");
+	char *arg2 = strtok(NULL, "\n");
+	if (!cmd) return;
+	if (strcmp(cmd, "end") == 0) {
+		raise(SIGTERM);
+		return;
+	}
+	char *p = arg;
+	if (arg && strcmp(cmd, "services") == 0) {
+		static size_t cap;
+		size_t n = parseuint(&p, SIZE_MAX, 10);
+		bool oneshot = arg2 && strcmp(arg2, "oneshot") == 0;
+		for (size_t i = 0; i < n; ++i) {
+			simservices = sim_grow(simservices, &cap, nservices,
+				sizeof(*simservices)
+			);
+			simservices[nservices++] = (SimService){.oneshot = oneshot};
+		}
+		// must look modified to daemond even within the same tick
+		mtime = sim_before(mtime, simtime) ? simtime : mtime;
+		++mtime.tv_nsec;
+	} else if (arg && strcmp(cmd, "crash") == 0) {
+		size_t n = parseuint(&p, SIZE_MAX, 10);
+		size_t start = nservices ? rand() % nservices : 0;
+		for (size_t i = 0; i < nservices && n; ++i) {
+			SimService *srv = &simservices[(start + i) % nservices];
+			if (srv->pid <= 0) continue;
+			sim_terminate(srv->pid, SIM_EXITED(1));
+			--n;
+		}
+	} else {
+		int i = arg ? sim_service(arg) : -1;
+		if (i < 0 || !arg2) {
+			LOG("invalid simulation event: %s %s!", cmd, arg ? arg : "");
+			return;
+		}
+		SimService *srv = &simservices[i];
+		if (strcmp(cmd, "exit") == 0) {
+			p = arg2;
+			if (srv->pid > 0) {
+				sim_terminate(srv->pid, SIM_EXITED(parseuint(&p, 255, 10)));
+			}
+		} else if (strcmp(cmd, "signal") == 0) {
+			int sig = getsignal(arg2);
+			if (srv->pid > 0 && sig > 0) sim_terminate(srv->pid, SIM_SIGNALED(sig));
+		} else if (strcmp(cmd, "priority") == 0) {
+			p = arg2;
+			srv->priority = parseuint(&p, UINT_MAX, 10);
+		} else if (strcmp(cmd, "control") == 0) {
+			size_t n = strlen(arg2);
+			char *buf = realloc(srv->killbuf, srv->killlen + n + 1);
+			if (!buf) DIE("simulation out of memory!");
+			memcpy(buf + srv->killlen, arg2, n);
+			buf[srv->killlen + n] = '\n';
+			srv->killbuf = buf;
+			srv->killlen += n + 1;
+		} else {
+			LOG("invalid simulation event: %s!", cmd);
+		}
+	}
+}
+
+static int sim_clock_gettime(clockid_t clock, struct timespec *t) {
+	if (clock != CLOCK_MONOTONIC) return clock_gettime(clock, t);
+	*t = simtime;
+	return 0;
+}
+
+static pid_t sim_fork(void) {
+	static size_t cap;
+	children = sim_grow(children, &cap, nchildren, sizeof(*children));
+	children[nchildren] = (SimChild){.srv = -1, .alive = true};
+	++stats.forks;
+	return SIM_PID + nchildren++;
+}
+
+static pid_t sim_waitpid(pid_t pid, int *status, int options) {
+	if (pid != -1 || zombies_head == zombies_len) return errno = ECHILD, -1;
+	pid = zombies[zombies_head++];
+	*status = zombies[zombies_head++];
+	++stats.reaps;
+	return pid;
+}
+
+static int sim_kill(pid_t pid, int sig) {
+	if (pid < SIM_PID || (size_t)(pid - SIM_PID) >= nchildren ||
+		!children[pid - SIM_PID].alive
+	) return errno = ESRCH, -1;
+	++stats.signals;
+	switch (sig) {
+	case 0:
+	case SIGCHLD:
+	case SIGCONT:
+	case SIGURG:
+	case SIGWINCH:
+		break;
+	default:
+		sim_terminate(pid, SIM_SIGNALED(sig));
+	}
+	return 0;
+}
+
+/* runs the script up to the next thing daemond would wake up for */
+static int sim_ppoll(struct pollfd *pfds, nfds_t n,
+	const struct timespec *timeout, const sigset_t *sigmask
+) {
+	struct timespec limit = simtime;
+	if (timeout) {
+		limit.tv_sec += timeout->tv_sec;
+		limit.tv_nsec += timeout->tv_nsec;
+		if (limit.tv_nsec >= 1000000000) {
+			limit.tv_nsec -= 1000000000;
+			++limit.tv_sec;
+		}
+	}
+	bool woken = false; // like by a timeout, the tree might have changed
+	++stats.polls;
+	while (1) {
+		// real signals, e.g. from the end event, are delivered as usual
+		sigset_t pending;
+		sigpending(&pending);
+		if (sigismember(&pending, SIGHUP) || sigismember(&pending, SIGINT) ||
+			sigismember(&pending, SIGTERM)
+		) {
+			sigset_t old;
+			sigprocmask(SIG_SETMASK, sigmask, &old);
+			sigprocmask(SIG_SETMASK, &old, NULL);
+			return errno = EINTR, -1;
+		}
+		if (zombies_head < zombies_len) return errno = EINTR, -1; // SIGCHLD
+
+		int ready = 0;
+		for (nfds_t i = 0; i < n; ++i) {
+			SimFd *f = sim_fd(pfds[i].fd);
+			pfds[i].revents = 0;
+			if (f && f->kind == SIM_KILLR && simservices[f->srv].killlen) {
+				pfds[i].revents = POLLIN;
+				++ready;
+			}
+		}
+		if (ready) return ready;
+		if (woken || (timeout && !sim_before(simtime, limit))) return 0;
+
+		if (nextevent < nevents &&
+			(!timeout || sim_before(events[nextevent].time, limit))
+		) {
+			if (sim_before(simtime, events[nextevent].time)) {
+				simtime = events[nextevent].time;
+			}
+			while (nextevent < nevents &&
+				!sim_before(simtime, events[nextevent].time)
+			) sim_event(events[nextevent++].line);
+			woken = true;
+		} else if (timeout) {
+			simtime = limit;
+		} else {
+			raise(SIGTERM); // nothing is ever going to happen
+		}
+	}
+}
+
+static int sim_openat(int dirfd, const char *path, int flags, mode_t mode) {
+	SimFd fd = {.srv = -1};
+	if (dirfd == AT_FDCWD) {
+		if (strcmp(path, execdir) == 0) {
+			fd.kind = SIM_EXECDIR;
+		} else if ((fd.srv = sim_service(path)) >= 0) {
+			fd.kind = SIM_DIR;
+		} else {
+			return errno = ENOENT, -1;
+		}
+	} else {
+		SimFd *dir = sim_fd(dirfd);
+		if (!dir) return errno = EBADF, -1;
+		fd.srv = dir->srv;
+		if (dir->kind != SIM_DIR) {
+			return errno = ENOENT, -1;
+		} else if (strcmp(path, killpipe) == 0) {
+			fd.kind = (flags & O_ACCMODE) == O_RDONLY ? SIM_KILLR : SIM_KILLW;
+		} else if (flags & O_CREAT) {
+			fd.kind = strcmp(path, pidfile) == 0 ? SIM_PIDFILE : SIM_FILE;
+		} else if (strcmp(path, priorityfile) == 0 &&
+			simservices[fd.srv].priority
+		) {
+			fd.kind = SIM_PRIORITY;
+		} else {
+			return errno = ENOENT, -1;
+		}
+	}
+	return sim_newfd(fd);
+}
+
+static int sim_close(int fd) {
+	SimFd *f = sim_fd(fd);
+	if (fd < SIM_FD) return close(fd);
+	if (!f) return errno = EBADF, -1;
+	f->kind = SIM_FREE;
+	f->srv = freefd;
+	freefd = fd - SIM_FD;
+	return 0;
+}
+
+static ssize_t sim_read(int fd, void *buf, size_t n) {
+	SimFd *f = sim_fd(fd);
+	if (fd < SIM_FD) return read(fd, buf, n);
+	if (!f) return errno = EBADF, -1;
+	if (f->kind == SIM_PRIORITY) {
+		char str[16];
+		int len = snprintf(str, sizeof(str), "%u\n",
+			simservices[f->srv].priority
+		);
+		n = MIN(n, (size_t)len);
+		memcpy(buf, str, n);
+		return n;
+	}
+	if (f->kind != SIM_KILLR) return 0;
+	SimService *srv = &simservices[f->srv];
+	if (!srv->killlen) return errno = EAGAIN, -1;
+	n = MIN(n, srv->killlen);
+	memcpy(buf, srv->killbuf, n);
+	memmove(srv->killbuf, srv->killbuf + n, srv->killlen - n);
+	srv->killlen -= n;
+	stats.commands += memchr(buf, '\n', n) != NULL;
+	return n;
+}
+
+static ssize_t sim_pread(int fd, void *buf, size_t n, off_t offset) {
+	if (fd < SIM_FD) return pread(fd, buf, n, offset);
+	return errno = EINVAL, -1;
+}
+
+static ssize_t sim_write(int fd, const void *buf, size_t n) {
+	SimFd *f = sim_fd(fd);
+	if (fd < SIM_FD) return write(fd, buf, n);
+	if (!f) return errno = EBADF, -1;
+	if (f->kind == SIM_PIDFILE) {
+		char str[32];
+		snprintf(str, sizeof(str), "%.*s", (int)MIN(n, sizeof(str) - 1),
+			(const char *)buf
+		);
+		char *p = str;
+		uintmax_t pid = parseuint(&p, INT_MAX, 10);
+		if (pid >= SIM_PID && pid - SIM_PID < nchildren) {
+			children[pid - SIM_PID].srv = f->srv;
+			simservices[f->srv].pid = pid;
+		}
+	}
+	return n;
+}
+
+static int sim_fcntl(int fd, int cmd, int arg) {
+	if (fd < SIM_FD) return fcntl(fd, cmd, arg);
+	if (!sim_fd(fd)) return errno = EBADF, -1;
+	return 0;
+}
+
+static int sim_fstatat(int dirfd, const char *path, struct stat *st,
+	int flags
+) {
+	if (dirfd != AT_FDCWD || strcmp(path, execdir) != 0) {
+		return errno = ENOENT, -1;
+	}
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFDIR | 0755;
+	st->st_mtim = mtime;
+	return 0;
+}
+
+static int sim_faccessat(int dirfd, const char *path, int mode, int flags) {
+	SimFd *dir = sim_fd(dirfd);
+	if (dir && dir->kind == SIM_EXECDIR && sim_service(path) >= 0) return 0;
+	if (dir && dir->kind == SIM_DIR && strcmp(path, oneshotfile) == 0 &&
+		simservices[dir->srv].oneshot
+	) return 0;
+	return errno = ENOENT, -1;
+}
+
+static int sim_mkdirat(int dirfd, const char *path, mode_t mode) {
+	return 0;
+}
+
+static int sim_unlinkat(int dirfd, const char *path, int flags) {
+	return 0;
+}
+
+static void *sim_opendir(int dirfd) {
+	SimFd *dir = sim_fd(dirfd);
+	if (!dir || dir->kind != SIM_EXECDIR) return errno = ENOTDIR, NULL;
+	return calloc(1, sizeof(size_t) + 32);
+}
+
+static const char *sim_readdir(void *dir) {
+	size_t *i = dir;
+	char *name = (char *)(i + 1);
+	if (*i >= nservices) return NULL;
+	snprintf(name, 32, "s%zu", (*i)++);
+	return name;
+}
+
+static void sim_closedir(void *dir) {
+	free(dir);
+}
+
+/* without change notification, configurations are compiled on every spawn */
+static int sim_watchinit(void) {
+	return errno = ENOSYS, -1;
+}
+
+static int sim_watch(int fd, const char *path) {
+	return errno = ENOSYS, -1;
+}
+
+static int sim_unwatch(int fd, int wd) {
+	return errno = ENOSYS, -1;
+}
+
+const Sys sys_sim = {
+	.clock_gettime = sim_clock_gettime,
+	.fork = sim_fork,
+	.waitpid = sim_waitpid,
+	.kill = sim_kill,
+	.ppoll = sim_ppoll,
+	.openat = sim_openat,
+	.close = sim_close,
+	.read = sim_read,
+	.pread = sim_pread,
+	.write = sim_write,
+	.fcntl = sim_fcntl,
+	.fstatat = sim_fstatat,
+	.faccessat = sim_faccessat,
+	.mkdirat = sim_mkdirat,
+	.mkfifoat = sim_mkdirat,
+	.unlinkat = sim_unlinkat,
+	.opendir = sim_opendir,
+	.readdir = sim_readdir,
+	.closedir = sim_closedir,
+	.watchinit = sim_watchinit,
+	.watch = sim_watch,
+	.unwatch = sim_unwatch
+};
+
+static void sim_report(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	dprintf(2, "%s: simulated %.3fs in %.3fs: %lu services, %lu polls, "
+		"%lu forks, %lu reaps, %lu signals, %lu commands\n",
+		argv0, simtime.tv_sec + simtime.tv_nsec / 1e9,
+		(t.tv_sec - started.tv_sec) + (t.tv_nsec - started.tv_nsec) / 1e9,
+		(unsigned long)nservices, stats.polls, stats.forks, stats.reaps,
+		stats.signals, stats.commands
+	);
+}
+
+void sim_init(void) {
+	static size_t cap;
+	char *line = NULL;
+	size_t size = 0;
+	unsigned long lineno = 0;
+	while (getline(&line, &size, stdin) > 0) {
+		++lineno;
+		char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p) continue;
+		char *end;
+		double t = strtod(p, &end);
+		if (end == p || t < 0) DIE("invalid time on script line %lu!", lineno);
+		struct timespec time = {
+			.tv_sec = t,
+			.tv_nsec = (t - (time_t)t) * 1e9
+		};
+		if (nevents && sim_before(time, events[nevents - 1].time)) {
+			DIE("script line %lu is out of order!", lineno);
+		}
+		events = sim_grow(events, &cap, nevents, sizeof(*events));
+		events[nevents].time = time;
+		events[nevents].line = strdup(end);
+		if (!events[nevents++].line) DIE("simulation out of memory!");
+	}
+	free(line);
+	srand(1); // runs must be repeatable
+	sys = &sys_sim;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	atexit(sim_report);
+}
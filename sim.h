@@ -0,0 +1,4 @@
+extern const Sys sys_sim;
+
+/* reads the script from stdin and makes sys the simulation */
+void sim_init(void);
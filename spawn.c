@@ -0,0 +1,222 @@
+/* spawn - starts service processes, directly or through a helper */
+
+#ifdef __linux__
+#define _GNU_SOURCE // execveat, CLONE_PARENT, SOCK_CLOEXEC, MAP_ANONYMOUS
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "spawn.h"
+#include "util.h"
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+#define O_DIRFD (O_PATH | O_DIRECTORY | O_CLOEXEC)
+
+/* a request is this header followed by len bytes of NUL terminated strings:
+ * cwd, dir and file, then argc arguments and envc environment variables
+ * the reply is a long, the pid or -errno if forking failed
+ */
+typedef struct {
+	size_t len;
+	unsigned slot;
+	unsigned argc;
+	unsigned envc;
+} SpawnRequest;
+
+struct rlimit spawn_nofile = {RLIM_INFINITY, RLIM_INFINITY};
+
+void spawn_exec(int cwdfd, int dirfd, const char *file, char *const argv[],
+	char *const envp[]
+) {
+	sigset_t sigmask;
+	errno = 0;
+	sigemptyset(&sigmask);
+	sigprocmask(SIG_SETMASK, &sigmask, NULL);
+	fchdir(cwdfd);
+	setsid();
+	close(0);
+	close(1);
+	close(2);
+	if (errno) _exit(125);
+	setrlimit(RLIMIT_NOFILE, &spawn_nofile);
+#ifdef __linux__
+	execveat(dirfd, file, argv, envp, 0);
+	// #! scripts are passed to their interpreter as /dev/fd/<dirfd>/<file>,
+	// which fails while dirfd is close-on-exec. others don't get to see it
+	if (errno == ENOENT) {
+		fcntl(dirfd, F_SETFD, 0);
+		execveat(dirfd, file, argv, envp, 0);
+	}
+#else
+	int fd = openat(dirfd, file, O_RDONLY);
+	if (fd >= 0) fexecve(fd, argv, envp);
+#endif
+	_exit(127);
+}
+
+/* waits at most timeout ms for each read, -1 for no limit */
+static int spawn_readfull(int fd, void *buf, size_t n, int timeout) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	for (char *p = buf; n;) {
+		int ready = timeout < 0 ? 1 : poll(&pfd, 1, timeout);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready == 0) errno = ETIMEDOUT;
+		if (ready <= 0) return -1;
+		ssize_t r = read(fd, p, n);
+		if (r == 0) errno = EPIPE;
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* the other side may be gone, which mustn't raise SIGPIPE
+ * waits at most timeout ms for each write, -1 for no limit
+ */
+static int spawn_writefull(int fd, const void *buf, size_t n, int timeout) {
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+	for (const char *p = buf; n;) {
+		int ready = timeout < 0 ? 1 : poll(&pfd, 1, timeout);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready == 0) errno = ETIMEDOUT;
+		if (ready <= 0) return -1;
+		ssize_t r = send(fd, p, n,
+			MSG_NOSIGNAL | (timeout < 0 ? 0 : MSG_DONTWAIT)
+		);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (r < 0) return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+/* forks services until the supervisor closes its end of fd */
+static void spawn_helper(int fd, pid_t *pids) {
+	SpawnRequest req;
+	char *buf = NULL;
+	char **ptrs = NULL;
+	while (spawn_readfull(fd, &req, sizeof(req), -1) >= 0) {
+		if (req.slot >= SPAWN_WINDOW) break;
+		char *p = realloc(buf, req.len + 1);
+		if (!p) break;
+		buf = p;
+		char **v = realloc(ptrs, (3 + req.argc + req.envc + 2) * sizeof(*v));
+		if (!v) break;
+		ptrs = v;
+		if (spawn_readfull(fd, buf, req.len, -1) < 0) break;
+		buf[req.len] = '\0';
+
+		// 3 fixed strings, then argv and envp, each NULL terminated
+		char **argv = ptrs + 3, **envp = argv + req.argc + 1;
+		size_t n = 0, want = 3 + req.argc + req.envc;
+		for (p = buf; p < buf + req.len && n < want; p += strlen(p) + 1) {
+			ptrs[n < 3 + req.argc ? n : n + 1] = p;
+			++n;
+		}
+		if (n != want || p != buf + req.len) break;
+		argv[req.argc] = envp[req.envc] = NULL;
+
+		// a sibling rather than a child, so the supervisor can wait for it
+		// the parent tid is the third argument on all but a few architectures
+		long pid = syscall(SYS_clone,
+			CLONE_PARENT | CLONE_PARENT_SETTID | SIGCHLD, 0, &pids[req.slot],
+			0, 0
+		);
+		if (pid == 0) {
+			spawn_exec(open(ptrs[0], O_DIRFD), open(ptrs[1], O_DIRFD),
+				ptrs[2], argv, envp
+			);
+		}
+		if (pid < 0) pid = -errno;
+		if (spawn_writefull(fd, &pid, sizeof(pid), -1) < 0) break;
+	}
+	_exit(0);
+}
+#endif
+
+/* started early, while the supervisor is small, and only ever forks itself
+ * with nothing of the supervisor open
+ */
+int spawn_zygote(pid_t *pid, pid_t **pids) {
+#ifdef __linux__
+	int sv[2];
+	// shared with the spawner, which has the kernel write to it
+	*pids = mmap(NULL, SPAWN_WINDOW * sizeof(**pids), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0
+	);
+	if (*pids == MAP_FAILED) return -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		munmap(*pids, SPAWN_WINDOW * sizeof(**pids));
+		return -1;
+	}
+	*pid = fork();
+	if (*pid < 0) {
+		munmap(*pids, SPAWN_WINDOW * sizeof(**pids));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	} else if (*pid == 0) {
+		if (dup2(sv[1], 3) < 0 || fcntl(3, F_SETFD, FD_CLOEXEC) < 0) _exit(1);
+#ifdef SYS_close_range
+		if (syscall(SYS_close_range, 4, ~0U, 0) < 0)
+#endif
+		for (long fd = 4, max = sysconf(_SC_OPEN_MAX); fd < max; ++fd) {
+			close(fd);
+		}
+		spawn_helper(3, *pids);
+	}
+	close(sv[1]);
+	return sv[0];
+#else
+	return errno = ENOSYS, -1;
+#endif
+}
+
+int spawn_request(int fd, unsigned slot, const char *cwd, const char *dir,
+	const char *file, char *const argv[], char *const envp[]
+) {
+	SpawnRequest req = {.slot = slot};
+	const char *fixed[] = {cwd, dir, file};
+	for (size_t i = 0; i < lenof(fixed); ++i) req.len += strlen(fixed[i]) + 1;
+	for (; argv[req.argc]; ++req.argc) req.len += strlen(argv[req.argc]) + 1;
+	for (; envp[req.envc]; ++req.envc) req.len += strlen(envp[req.envc]) + 1;
+
+	char *buf = malloc(sizeof(req) + req.len);
+	if (!buf) return -1;
+	memcpy(buf, &req, sizeof(req));
+	char *p = buf + sizeof(req);
+	for (size_t i = 0; i < lenof(fixed); ++i) p = stpcpy(p, fixed[i]) + 1;
+	for (unsigned i = 0; i < req.argc; ++i) p = stpcpy(p, argv[i]) + 1;
+	for (unsigned i = 0; i < req.envc; ++i) p = stpcpy(p, envp[i]) + 1;
+	int ret = spawn_writefull(fd, buf, sizeof(req) + req.len, SPAWN_TIMEOUT);
+	free(buf);
+	return ret;
+}
+
+int spawn_reply(int fd, pid_t *pid) {
+	long reply;
+	if (spawn_readfull(fd, &reply, sizeof(reply), SPAWN_TIMEOUT) < 0) return -1;
+	*pid = reply < 0 ? -1 : reply;
+	if (reply < 0) errno = -reply;
+	return 0;
+}
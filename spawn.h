@@ -0,0 +1,35 @@
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/* common setup in forked children, then execs file relative to dirfd with the
+ * working directory cwdfd. _exits if anything fails, so the supervisor's atexit
+ * handlers don't run in the child
+ */
+void spawn_exec(int cwdfd, int dirfd, const char *file, char *const argv[],
+	char *const envp[]
+);
+/* the limit on open files as inherited, which the supervisor raises for itself
+ * and spawn_exec restores
+ */
+extern struct rlimit spawn_nofile;
+
+/* the spawner is a small helper process that forks services on behalf of the
+ * supervisor, so they don't pay for copying its address space
+ * its children are siblings of it, so they can be waited for as usual
+ * spawn_zygote returns the socket to send requests to and sets *pid to the
+ * spawner. replies come back in order and there must be no more than
+ * SPAWN_WINDOW outstanding, each in its own slot. the kernel stores the pid of
+ * the process spawned for a request in (*pids)[slot] as it creates it, so it
+ * is known even if the spawner dies before replying
+ */
+#define SPAWN_WINDOW 32
+#define SPAWN_TIMEOUT 1000 // ms to wait for a reply
+int spawn_zygote(pid_t *pid, pid_t **pids);
+/* returns -1 if the spawner is gone or didn't take it within SPAWN_TIMEOUT */
+int spawn_request(int fd, unsigned slot, const char *cwd, const char *dir,
+	const char *file, char *const argv[], char *const envp[]
+);
+/* returns -1 if the spawner is gone or didn't reply within SPAWN_TIMEOUT,
+ * otherwise *pid is as returned by fork
+ */
+int spawn_reply(int fd, pid_t *pid);
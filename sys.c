@@ -0,0 +1,147 @@
+/* sys - the operating system backend of the supervisor */
+
+#ifdef __linux__
+#define _GNU_SOURCE // ppoll
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "sys.h"
+#include "util.h"
+
+const Sys *sys = &sys_os;
+
+#ifdef __linux__
+static int os_ppoll(struct pollfd *fds, nfds_t nfds,
+	const struct timespec *timeout, const sigset_t *sigmask
+) {
+	return ppoll(fds, nfds, timeout, sigmask);
+}
+#else
+/* limited to FD_SETSIZE, but pselect is the only portable way to wait for
+ * fds and signals without a race
+ */
+static int os_ppoll(struct pollfd *fds, nfds_t nfds,
+	const struct timespec *timeout, const sigset_t *sigmask
+) {
+	int maxfd = -1;
+	fd_set readfds, writefds;
+	FD_ZERO(&readfds);
+	FD_ZERO(&writefds);
+	for (nfds_t i = 0; i < nfds; ++i) {
+		if (fds[i].fd < 0) continue;
+		if (fds[i].fd >= FD_SETSIZE) return errno = EINVAL, -1;
+		if (fds[i].events & POLLIN) FD_SET(fds[i].fd, &readfds);
+		if (fds[i].events & POLLOUT) FD_SET(fds[i].fd, &writefds);
+		maxfd = MAX(maxfd, fds[i].fd);
+	}
+	int n = pselect(maxfd + 1, &readfds, &writefds, NULL, timeout, sigmask);
+	if (n <= 0) return n;
+	n = 0;
+	for (nfds_t i = 0; i < nfds; ++i) {
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) continue;
+		if (FD_ISSET(fds[i].fd, &readfds)) fds[i].revents |= POLLIN;
+		if (FD_ISSET(fds[i].fd, &writefds)) fds[i].revents |= POLLOUT;
+		if (fds[i].revents) ++n;
+	}
+	return n;
+}
+#endif
+
+static int os_openat(int dirfd, const char *path, int flags, mode_t mode) {
+	return openat(dirfd, path, flags, mode);
+}
+
+static int os_fcntl(int fd, int cmd, int arg) {
+	return fcntl(fd, cmd, arg);
+}
+
+static void *os_opendir(int dirfd) {
+	int fd = dup(dirfd);
+	if (fd < 0) return NULL;
+	DIR *dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return NULL;
+	}
+	rewinddir(dir); // the offset is shared with dirfd
+	return dir;
+}
+
+static const char *os_readdir(void *dir) {
+	// i don't like dirent
+	struct dirent *entry = readdir(dir);
+	return entry ? entry->d_name : NULL;
+}
+
+static void os_closedir(void *dir) {
+	closedir(dir);
+}
+
+#ifdef __linux__
+static int os_watchinit(void) {
+	return inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+static int os_watch(int fd, const char *path) {
+	return inotify_add_watch(fd, path, IN_ONLYDIR | IN_ATTRIB |
+		IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF |
+		IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF
+	);
+}
+
+static int os_unwatch(int fd, int wd) {
+	return inotify_rm_watch(fd, wd);
+}
+#else
+static int os_watchinit(void) {
+	return errno = ENOSYS, -1;
+}
+
+static int os_watch(int fd, const char *path) {
+	return errno = ENOSYS, -1;
+}
+
+static int os_unwatch(int fd, int wd) {
+	return errno = ENOSYS, -1;
+}
+#endif
+
+const Sys sys_os = {
+	.clock_gettime = clock_gettime,
+	.fork = fork,
+	.waitpid = waitpid,
+	.kill = kill,
+	.ppoll = os_ppoll,
+	.openat = os_openat,
+	.close = close,
+	.read = read,
+	.pread = pread,
+	.write = write,
+	.fcntl = os_fcntl,
+	.fstatat = fstatat,
+	.faccessat = faccessat,
+	.mkdirat = mkdirat,
+	.mkfifoat = mkfifoat,
+	.unlinkat = unlinkat,
+	.opendir = os_opendir,
+	.readdir = os_readdir,
+	.closedir = os_closedir,
+	.watchinit = os_watchinit,
+	.watch = os_watch,
+	.unwatch = os_unwatch
+};
@@ -0,0 +1,46 @@
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+typedef struct Sys Sys;
+
+/* everything the supervisor does to processes and the service tree goes
+ * through here, so it can be swapped for a simulation (see sim.c)
+ * the members behave like the system calls they are named after
+ */
+struct Sys {
+	int (*clock_gettime)(clockid_t clock, struct timespec *t);
+	pid_t (*fork)(void);
+	pid_t (*waitpid)(pid_t pid, int *status, int options);
+	int (*kill)(pid_t pid, int sig);
+	int (*ppoll)(struct pollfd *fds, nfds_t nfds,
+		const struct timespec *timeout, const sigset_t *sigmask
+	);
+	int (*openat)(int dirfd, const char *path, int flags, mode_t mode);
+	int (*close)(int fd);
+	ssize_t (*read)(int fd, void *buf, size_t n);
+	ssize_t (*pread)(int fd, void *buf, size_t n, off_t offset);
+	ssize_t (*write)(int fd, const void *buf, size_t n);
+	int (*fcntl)(int fd, int cmd, int arg);
+	int (*fstatat)(int dirfd, const char *path, struct stat *st, int flags);
+	int (*faccessat)(int dirfd, const char *path, int mode, int flags);
+	int (*mkdirat)(int dirfd, const char *path, mode_t mode);
+	int (*mkfifoat)(int dirfd, const char *path, mode_t mode);
+	int (*unlinkat)(int dirfd, const char *path, int flags);
+	/* lists the names in a directory, NULL at the end */
+	void *(*opendir)(int dirfd);
+	const char *(*readdir)(void *dir);
+	void (*closedir)(void *dir);
+	/* change notification for a directory and the files in it, read events
+	 * from the fd of watchinit. fail with ENOSYS where there is none
+	 */
+	int (*watchinit)(void);
+	int (*watch)(int fd, const char *path);
+	int (*unwatch)(int fd, int wd);
+};
+
+extern const Sys sys_os;
+extern const Sys *sys;
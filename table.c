@@ -0,0 +1,91 @@
+/* table - open addressing hash table with linear probing, used for indexes */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "table.h"
+#include "util.h"
+
+/* callers pass keys like pids as their own hash, and sequential ones would
+ * make one long cluster, so they are scrambled before picking a slot
+ * (the splitmix64 finalizer)
+ */
+static size_t table_home(size_t hash, size_t mask) {
+	uint64_t x = hash;
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return (x ^ (x >> 31)) & mask;
+}
+
+static int table_grow(Table *self) {
+	size_t cap = MAX(self->cap * 2, 16);
+	TableEntry *entries = calloc(cap, sizeof(*entries));
+	if (!entries) return -1;
+	for (size_t i = 0; i < self->cap; ++i) {
+		TableEntry *e = &self->entries[i];
+		if (!e->element) continue;
+		size_t j = table_home(e->hash, cap - 1);
+		while (entries[j].element) j = (j + 1) & (cap - 1);
+		entries[j] = *e;
+	}
+	free(self->entries);
+	self->entries = entries;
+	self->cap = cap;
+	return 0;
+}
+
+void *table_next(const Table *self, size_t hash, size_t *i) {
+	size_t mask = self->cap - 1, home = table_home(hash, mask);
+	while (*i < self->cap) {
+		TableEntry *e = &self->entries[(home + (*i)++) & mask];
+		if (!e->element) break;
+		if (e->hash == hash) return e->element;
+	}
+	*i = self->cap;
+	return NULL;
+}
+
+/* keeps the load under 3/4 */
+int table_add(Table *self, size_t hash, void *element) {
+	if ((self->len + 1) * 4 > self->cap * 3 && table_grow(self) < 0) return -1;
+	size_t mask = self->cap - 1, i = table_home(hash, mask);
+	while (self->entries[i].element) i = (i + 1) & mask;
+	self->entries[i] = (TableEntry){hash, element};
+	++self->len;
+	return 0;
+}
+
+/* shifts the following entries back instead of leaving tombstones */
+void table_remove(Table *self, size_t hash, const void *element) {
+	if (!self->cap) return;
+	size_t mask = self->cap - 1, i = table_home(hash, mask);
+	// an element may be in the table under more than one hash
+	while (self->entries[i].element != element ||
+		self->entries[i].hash != hash
+	) {
+		if (!self->entries[i].element) return;
+		i = (i + 1) & mask;
+	}
+	for (size_t j = i;;) {
+		self->entries[i].element = NULL;
+		TableEntry *e;
+		do {
+			j = (j + 1) & mask;
+			e = &self->entries[j];
+			if (!e->element) {
+				--self->len;
+				return;
+			}
+			// entries whose home is cyclically in (i, j] stay
+		} while (((j - table_home(e->hash, mask)) & mask) < ((j - i) & mask));
+		self->entries[i] = *e;
+		i = j;
+	}
+}
+
+/* FNV-1a */
+size_t table_hashstr(const char *str) {
+	size_t hash = (size_t)14695981039346656037u;
+	while (*str) hash = (hash ^ (unsigned char)*str++) * (size_t)1099511628211u;
+	return hash;
+}
@@ -0,0 +1,24 @@
+#include <stddef.h>
+
+typedef struct Table Table;
+typedef struct TableEntry TableEntry;
+
+struct TableEntry {
+	size_t hash;
+	void *element; // NULL when the slot is free
+};
+
+/* the caller hashes, and compares the elements that come back */
+struct Table {
+	TableEntry *entries;
+	size_t len;
+	size_t cap; // 0 or a power of two
+};
+
+/* iterates over the elements added with hash, *i starts at 0
+ * returns NULL at the end
+ */
+void *table_next(const Table *self, size_t hash, size_t *i);
+int table_add(Table *self, size_t hash, void *element);
+void table_remove(Table *self, size_t hash, const void *element);
+size_t table_hashstr(const char *str);
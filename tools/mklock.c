@@ -1,46 +1,163 @@
+/* mklock - create lock files, or hold a lock while a command runs */
+
+#ifdef __linux__
+#define _GNU_SOURCE // F_OFD_SETLKW, ppoll
+#endif
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include "../parsechmod.h"
 #include "../util.h"
 
+/* open file description locks belong to the fd rather than the process, but
+ * both kinds survive exec
+ */
+#ifdef F_OFD_SETLKW
+#define SETLK F_OFD_SETLK
+#define SETLKW F_OFD_SETLKW
+#else
+#define SETLK F_SETLK
+#define SETLKW F_SETLKW
+#endif
+
 const char *argv0;
+bool waitlock;
+volatile sig_atomic_t timedout;
+sigset_t waitmask; // the mask while waiting, when SIGALRM is unblocked
 
 void usage(void) {
-	dprintf(2, "usage: %s [-m mode] file...", argv0);
+	dprintf(2,
+		"usage: %s [-m mode] [-w | -t timeout] file...\n"
+		"       %s -x [-m mode] [-w | -t timeout] file command [arg...]\n",
+		argv0, argv0
+	);
 	exit(1);
 }
 
+static void handle_alarm(int sig) {
+	timedout = 1;
+}
+
+/* blocks until file might have been removed, interrupted by the alarm
+ * if it is removed before the watch is set up, adding the watch fails
+ */
+static void waitremoved(const char *file) {
+#ifdef __linux__
+	int fd = inotify_init1(IN_CLOEXEC);
+	if (fd >= 0) {
+		// unlinking changes the link count, which counts as IN_ATTRIB
+		if (inotify_add_watch(fd, file,
+			IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF
+		) >= 0) {
+			struct pollfd pfd = {.fd = fd, .events = POLLIN};
+			ppoll(&pfd, 1, NULL, &waitmask);
+		}
+		close(fd);
+		return;
+	}
+#endif
+	pselect(0, NULL, NULL, NULL, &(struct timespec){.tv_sec = 1}, &waitmask);
+}
+
+static int mklock(const char *file, mode_t mode) {
+	int fd;
+	while ((fd = open(file, O_WRONLY|O_CREAT|O_EXCL, mode)) < 0) {
+		if (errno != EEXIST || !waitlock || timedout) return -1;
+		waitremoved(file);
+		if (timedout) return errno = EEXIST, -1;
+	}
+	close(fd);
+	return 0;
+}
+
+static void holdlock(char **argv, mode_t mode) {
+	int fd = open(*argv, O_RDWR|O_CREAT, mode);
+	if (fd < 0) DIE("failed to open %s: %s!", *argv, err());
+	struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+	// fcntl can't unblock it atomically, but the alarm repeats, see main
+	sigprocmask(SIG_SETMASK, &waitmask, NULL);
+	if (timedout || fcntl(fd, waitlock ? SETLKW : SETLK, &lock) < 0) {
+		if (timedout) errno = EAGAIN;
+		DIE("failed to lock %s: %s!", *argv, err());
+	}
+	setitimer(ITIMER_REAL, &(struct itimerval){{0}}, NULL);
+	execvp(argv[1], argv + 1); // the lock is released when fd is closed
+	LOG("failed to exec %s: %s!", argv[1], err());
+	exit(127);
+}
+
 int main(int argc, char **argv) {
 	const char *mstr = "+";
 	mode_t mode = 0666;
+	unsigned timeout = 0;
+	bool hold = false;
 	int c, errcount = 0;
 
 	argv0 = *argv;
-	while ((c = getopt(argc, argv, "m:")) >= 0) {
-		if (c == 'm') {
+	while ((c = getopt(argc, argv, "m:t:wx")) >= 0) {
+		switch (c) {
+		case 'm':
 			mstr = optarg;
-		} else {
+			break;
+		case 't':
+			{
+				char *p = optarg;
+				timeout = parseuint(&p, UINT_MAX, 10);
+				if (p == optarg || *p || !timeout) usage();
+			}
+			// fallthrough
+		case 'w':
+			waitlock = true;
+			break;
+		case 'x':
+			hold = true;
+			break;
+		default:
 			usage();
 		}
 	}
 	argv += optind;
 
-	if (!*argv || parsechmod(mstr, &mode, umask(0)) < 0) usage();
+	if (!*argv || (hold && !argv[1])) usage();
+	if (parsechmod(mstr, &mode, umask(0)) < 0) usage();
+	sigprocmask(SIG_BLOCK, NULL, &waitmask);
+	if (timeout) {
+		struct sigaction sa = {.sa_handler = handle_alarm}; // no SA_RESTART
+		if (sigemptyset(&sa.sa_mask) < 0 || sigaction(SIGALRM, &sa, NULL) < 0) {
+			DIE("failed to install signal handlers: %s", err());
+		}
+		sigaddset(&sa.sa_mask, SIGALRM);
+		sigprocmask(SIG_BLOCK, &sa.sa_mask, NULL);
+		// every second after the timeout, in case it came just before a wait
+		struct itimerval it = {
+			.it_value = {.tv_sec = timeout}, .it_interval = {.tv_sec = 1}
+		};
+		setitimer(ITIMER_REAL, &it, NULL);
+	}
+	if (hold) holdlock(argv, mode);
+
 	do {
-		int fd = open(*argv, O_WRONLY|O_CREAT|O_EXCL, mode);
-		if (fd >= 0) {
-			close(fd);
-		} else {
+		if (mklock(*argv, mode) < 0) {
 			LOG("failed to open %s: %s!", *argv, err());
 			++errcount;
 		}
 	} while (*++argv);
 
-	return errcount;
+	return MIN(errcount, 255); // the exit status is only 8 bits
 }
@@ -0,0 +1,288 @@
+/* svctl - send commands to services of daemond and wait until they are done */
+
+#ifdef __linux__
+#define _GNU_SOURCE // inotify_init1 flags, ppoll
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "../getsignal.h"
+#include "../util.h"
+
+/* must match service.c */
+#define EXECDIR "exec/"
+
+typedef struct Target Target;
+
+struct Target {
+	const char *name;
+	int wd; // watch on the service directory
+	bool oneshot;
+	bool needchange; // even if the state already is the target
+	bool changed; // the state file was written since the command was sent
+	bool dirty; // written since it was last checked
+	bool removed;
+	bool done;
+	bool failed;
+	char state[16];
+};
+
+const char *argv0;
+volatile sig_atomic_t timedout;
+
+const char *command;
+Target *targets;
+size_t ntargets;
+
+static void usage(void) {
+	dprintf(2,
+		"usage: %s [-j max_jobs] [-t timeout] up|down|restart|signal "
+		"pattern...\n",
+		argv0
+	);
+	exit(1);
+}
+
+static void handle_alarm(int sig) {
+	timedout = 1;
+}
+
+static void readstate(Target *t) {
+	char path[strlen(t->name) + sizeof("/state")];
+	snprintf(path, sizeof(path), "%s/state", t->name);
+	*t->state = '\0';
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	ssize_t n = read(fd, t->state, sizeof(t->state) - 1);
+	close(fd);
+	t->state[MAX(n, 0)] = '\0';
+	t->state[strcspn(t->state, "\n")] = '\0';
+}
+
+/* up and restart wait for a one-shot to finish, and for others to run */
+static void check(Target *t) {
+	t->dirty = false;
+	readstate(t);
+	if (t->removed) {
+		t->done = true;
+		t->failed = strcmp(command, "down") != 0;
+		return;
+	}
+	if (t->needchange && !t->changed) return;
+	if (strcmp(command, "down") == 0) {
+		t->done = strcmp(t->state, "down") == 0;
+	} else if (strcmp(t->state, "failed") == 0) {
+		t->done = t->failed = true;
+	} else {
+		const char *target = t->oneshot ? "succeeded" : "running";
+		t->done = strcmp(t->state, target) == 0;
+	}
+}
+
+/* marks the targets whose state file was written, or that were removed
+ * returns true if there were any
+ */
+static bool readevents(int wfd) {
+	bool any = false;
+#ifdef __linux__
+	static union {
+		struct inotify_event e; // for alignment
+		char buf[4096];
+	} u;
+	ssize_t len;
+	while (wfd >= 0 && (len = read(wfd, u.buf, sizeof(u.buf))) > 0) {
+		for (char *p = u.buf; p < u.buf + len;) {
+			struct inotify_event *e = (struct inotify_event *)p;
+			p += sizeof(*e) + e->len;
+			bool removed = e->mask & (IN_DELETE_SELF | IN_IGNORED);
+			if (!removed && (!e->len || strcmp(e->name, "state") != 0)) {
+				continue;
+			}
+			// the same directory may have been matched more than once
+			for (size_t i = 0; i < ntargets; ++i) {
+				if (targets[i].wd != e->wd) continue;
+				targets[i].changed = targets[i].dirty = true;
+				targets[i].removed |= removed;
+				any = true;
+			}
+		}
+	}
+#endif
+	return any;
+}
+
+/* returns false if there is nothing to wait for */
+static bool send(Target *t, int wfd) {
+	char path[strlen(t->name) + sizeof("/oneshot")];
+	snprintf(path, sizeof(path), "%s/oneshot", t->name);
+	t->oneshot = access(path, F_OK) == 0;
+	readstate(t);
+	// only writes of the state file after sending count as a change
+	readevents(wfd);
+	t->changed = false;
+	// a one-shot that is done or a service that is down will be started
+	t->needchange = strcmp(command, "restart") == 0 ||
+		(strcmp(command, "up") == 0 && strcmp(t->state, "running") != 0 &&
+			strcmp(t->state, "pending") != 0);
+
+	snprintf(path, sizeof(path), "%s/kill", t->name);
+	int fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0 || dprintf(fd, "%s\n", command) < 0) {
+		LOG("%s: failed to send %s: %s!", t->name, command, err());
+		t->done = t->failed = true;
+	}
+	if (fd >= 0) close(fd);
+	if (t->done) return false;
+
+	if (getsignal(command)) {
+		t->done = true;
+		return false;
+	}
+	check(t);
+	return !t->done;
+}
+
+static int addtargets(const char *pattern, int wfd) {
+	char path[sizeof(EXECDIR) + strlen(pattern)];
+	glob_t g;
+	snprintf(path, sizeof(path), EXECDIR "%s", pattern);
+	int ret = glob(path, 0, NULL, &g);
+	if (ret == GLOB_NOMATCH) {
+		LOG("no services match %s!", pattern);
+		return -1;
+	} else if (ret) {
+		DIE("failed to match %s!", pattern);
+	}
+	Target *p = realloc(targets, (ntargets + g.gl_pathc) * sizeof(*p));
+	if (!p) DIE("failed to allocate targets: %s!", err());
+	targets = p;
+	for (size_t i = 0; i < g.gl_pathc; ++i) {
+		Target *t = &targets[ntargets++];
+		*t = (Target){.name = strdup(g.gl_pathv[i] + sizeof(EXECDIR) - 1)};
+		if (!t->name) DIE("failed to allocate targets: %s!", err());
+		t->wd = -1;
+#ifdef __linux__
+		// the state file is rewritten in place, but may not exist yet
+		t->wd = inotify_add_watch(wfd, t->name,
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF
+		);
+		if (t->wd < 0) LOG("%s: failed to watch: %s", t->name, err());
+#endif
+	}
+	globfree(&g);
+	return 0;
+}
+
+/* blocks until a state file is written, or for a second without inotify,
+ * after which the state of every target is taken as changed
+ */
+static void waitchange(int wfd, const sigset_t *sigmask) {
+#ifdef __linux__
+	struct pollfd pfd = {.fd = wfd, .events = POLLIN};
+	// the alarm is only unblocked while waiting, so it can't be missed
+	while (wfd >= 0 && !timedout && !readevents(wfd)) {
+		ppoll(&pfd, 1, NULL, sigmask);
+	}
+	if (wfd >= 0) return;
+#endif
+	sleep(1);
+	for (size_t i = 0; i < ntargets; ++i) {
+		targets[i].changed = targets[i].dirty = true;
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned timeout = 0;
+	size_t jobs_max = SIZE_MAX;
+	int c, errcount = 0;
+
+	argv0 = *argv;
+	while ((c = getopt(argc, argv, "j:t:")) >= 0) {
+		char *p = optarg;
+		switch (c) {
+		case 'j':
+			jobs_max = parseuint(&p, SIZE_MAX, 10);
+			if (p == optarg || *p || !jobs_max) usage();
+			break;
+		case 't':
+			timeout = parseuint(&p, UINT_MAX, 10);
+			if (p == optarg || *p || !timeout) usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argv += optind;
+	if (!argv[0] || !argv[1]) usage();
+	command = *argv++;
+	if (!getsignal(command) && strcmp(command, "up") != 0 &&
+		strcmp(command, "down") != 0 && strcmp(command, "restart") != 0
+	) usage();
+
+	int wfd = -1;
+#ifdef __linux__
+	wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wfd < 0) LOG("failed to init inotify: %s", err());
+#endif
+	// watches are set up before sending, so no change can be missed
+	do {
+		if (addtargets(*argv, wfd) < 0) ++errcount;
+	} while (*++argv);
+
+	sigset_t sigmask;
+	if (timeout) {
+		struct sigaction sa = {.sa_handler = handle_alarm}; // no SA_RESTART
+		if (sigemptyset(&sa.sa_mask) < 0 || sigaction(SIGALRM, &sa, NULL) < 0) {
+			DIE("failed to install signal handlers: %s", err());
+		}
+		sigaddset(&sa.sa_mask, SIGALRM);
+		if (wfd >= 0) sigprocmask(SIG_BLOCK, &sa.sa_mask, &sigmask);
+		alarm(timeout);
+	}
+	if (!timeout || wfd < 0) sigprocmask(SIG_BLOCK, NULL, &sigmask);
+
+	// at most jobs_max services are between command and target at a time
+	size_t next = 0, waiting = 0;
+	while (!timedout) {
+		while (next < ntargets && waiting < jobs_max) {
+			if (send(&targets[next++], wfd)) ++waiting;
+		}
+		if (!waiting) break;
+		waitchange(wfd, &sigmask);
+		for (size_t j = 0; j < next; ++j) {
+			Target *t = &targets[j];
+			if (!t->done && t->dirty) {
+				check(t);
+				waiting -= t->done;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < ntargets; ++i) {
+		Target *t = &targets[i];
+		if (!t->done) {
+			LOG("%s: timed out, %s!",
+				t->name, *t->state ? t->state : "no state"
+			);
+			++errcount;
+		} else if (t->failed) {
+			LOG("%s: failed!", t->name);
+			++errcount;
+		}
+	}
+	return MIN(errcount, 255); // the exit status is only 8 bits
+}
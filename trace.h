@@ -0,0 +1,66 @@
+/* static tracepoints, compiled in with -D USDT and nothing otherwise
+ * they are systemtap style SDT notes under the provider daemond, so
+ * bpftrace, perf and the like can attach to them, e.g.
+ *   bpftrace -e 'usdt:./daemond:daemond:reap { printf("%s\n", str(arg0)); }'
+ * a probe site is a single nop until someone attaches, and pairs of _start and
+ * _done probes are meant for measuring durations in the tracer
+ * arguments are passed as intptr_t, strings as pointers
+ */
+
+#ifdef USDT
+#include <stdint.h>
+
+#if UINTPTR_MAX > 0xffffffff
+#define TRACE_ADDR_ ".8byte"
+#define TRACE_ARG_(n) "-8@%[a" #n "]"
+#else
+#define TRACE_ADDR_ ".4byte"
+#define TRACE_ARG_(n) "-4@%[a" #n "]"
+#endif
+
+/* like sys/sdt.h, which isn't a dependency this way */
+#define TRACE_ASM_(probe, args) \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: " TRACE_ADDR_ " 990b\n" \
+	TRACE_ADDR_ " _.stapsdt.base\n" \
+	TRACE_ADDR_ " 0\n" /* no semaphore */ \
+	".asciz \"daemond\"\n" \
+	".asciz \"" #probe "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+#define TRACE_OPERAND_(n, x) [a##n] "nor" ((intptr_t)(x))
+
+#define TRACE0(probe) __asm__ __volatile__ (TRACE_ASM_(probe, ""))
+#define TRACE1(probe, a0) __asm__ __volatile__ ( \
+	TRACE_ASM_(probe, TRACE_ARG_(0)) : : TRACE_OPERAND_(0, a0) \
+)
+#define TRACE2(probe, a0, a1) __asm__ __volatile__ ( \
+	TRACE_ASM_(probe, TRACE_ARG_(0) " " TRACE_ARG_(1)) \
+	: : TRACE_OPERAND_(0, a0), TRACE_OPERAND_(1, a1) \
+)
+#define TRACE3(probe, a0, a1, a2) __asm__ __volatile__ ( \
+	TRACE_ASM_(probe, \
+		TRACE_ARG_(0) " " TRACE_ARG_(1) " " TRACE_ARG_(2) \
+	) : : TRACE_OPERAND_(0, a0), TRACE_OPERAND_(1, a1), \
+		TRACE_OPERAND_(2, a2) \
+)
+#else
+#define TRACE0(probe) ((void)0)
+#define TRACE1(probe, a0) ((void)0)
+#define TRACE2(probe, a0, a1) ((void)0)
+#define TRACE3(probe, a0, a1, a2) ((void)0)
+#endif
@@ -25,13 +25,19 @@
 #define DIE(...) (LOG(__VA_ARGS__), exit(1))
 
 /* workaround for empty VA_ARGS */
-#define LOG_INTERNAL_(f, ...) dprintf(2, "%s: " f "%s\n", argv0, __VA_ARGS__)
+#define LOG_INTERNAL_(f, ...) LOG_PRINTF("%s: " f "%s\n", argv0, __VA_ARGS__)
+
+/* may be defined before including this header to log somewhere else */
+#ifndef LOG_PRINTF
+#define LOG_PRINTF(...) dprintf(2, __VA_ARGS__)
+#endif
 
 extern const char *argv0;
 
-/* thread-safe strerror(errno) */
+/* thread-safe strerror(errno), the locale is only created once */
 static inline const char *err(void) {
-	locale_t l = newlocale(LC_ALL_MASK, "", 0);
+	static locale_t l;
+	if (!l) l = newlocale(LC_ALL_MASK, "", 0);
 	if (!l) return "locale error";
 	return strerror_l(errno, l);
 }